@@ -0,0 +1,390 @@
+#include "daemon.h"
+#include "registry.h"
+#include "trace.h"
+#include "flow.h"
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <cstdlib>
+#include <pthread.h>
+#include <unistd.h>
+#include <ctime>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+using std::string;
+using std::vector;
+
+
+
+/*
+ * Longest query line accepted
+ */
+#define QUERY_MAX_LEN 256
+
+/*
+ * Most clients served at once, and how long a client may stay idle or stall
+ * reading a response before it is dropped (secs)
+ */
+#define QUERY_MAX_CLIENTS 64
+#define QUERY_IDLE_TIMEOUT 60
+#define QUERY_SEND_TIMEOUT 5
+
+
+
+/*
+ * A query server, answering queries over one registry on one socket
+ */
+struct query_server
+{
+	string path;				// path of the socket
+	const registry* summaries;	// the registry queries are answered from
+	int fd;						// the listening socket
+	int wakeup[2];				// pipe waking up the server thread to stop it
+	pthread_t thread;			// the server thread
+};
+
+
+
+/*
+ * Write a whole buffer to a client, ignoring clients that went away
+ */
+static bool send_all(int fd, const string& data)
+{
+	const char* ptr = data.data();
+	size_t left = data.size();
+
+	while (left > 0)
+	{
+		ssize_t n = send(fd, ptr, left, MSG_NOSIGNAL);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return false;
+
+		ptr += n;
+		left -= n;
+	}
+
+	return true;
+}
+
+
+
+/*
+ * Format a summary as a single line
+ */
+static void format_summary(string& out, const flow_summary& s)
+{
+	char line[256];
+	string id = flow(s.src_addr, s.src_port, s.dst_addr, s.dst_port).id();
+
+	snprintf(line, sizeof(line), " bytes=%lu retrans=%lu dupacks=%lu rtt_samples=%lu rtt_min=%lu rtt_avg=%lu first=%lu.%06lu last=%lu.%06lu\n",
+			s.bytes, s.retrans, s.dupacks, s.rtt_count, s.rtt_min, s.rtt_mean,
+			s.first / 1000000, s.first % 1000000, s.last / 1000000, s.last % 1000000);
+
+	out += id;
+	out += line;
+}
+
+
+
+/*
+ * Order summaries by bytes sent, most first (so a heap ordered by it has the
+ * fewest bytes on top)
+ */
+static bool more_bytes(const flow_summary& a, const flow_summary& b)
+{
+	return a.bytes > b.bytes;
+}
+
+
+
+/*
+ * Answer a single query
+ */
+static void answer(string& out, const registry& summaries, const char* query)
+{
+	uint32_t count = summaries.count();
+	flow_summary summary;
+
+	if (strncmp(query, "flow ", 5) == 0)
+	{
+		filter f;
+		if (!f.parse_connection(query + 5))
+		{
+			out += "error: invalid connection\n";
+			return;
+		}
+
+		flow conn(f.src_addr, f.src_port_start, f.dst_addr, f.dst_port_start);
+
+		if (summaries.find(conn, summary))
+			format_summary(out, summary);
+		if (summaries.find(conn.reverse(), summary))
+			format_summary(out, summary);
+	}
+	else if (strncmp(query, "top ", 4) == 0)
+	{
+		char* end;
+		unsigned long k = strtoul(query + 4, &end, 10);
+		if (*end != '\0' || k == 0)
+		{
+			out += "error: invalid count\n";
+			return;
+		}
+
+		if (k > count)
+			k = count;
+
+		// Keep the K flows with the most bytes so far in a heap
+		vector<flow_summary> top;
+		top.reserve(k);
+		for (uint32_t i = 0; i < count; ++i)
+		{
+			summaries.read(i, summary);
+
+			if (top.size() < k)
+			{
+				top.push_back(summary);
+				std::push_heap(top.begin(), top.end(), more_bytes);
+			}
+			else if (summary.bytes > top.front().bytes)
+			{
+				std::pop_heap(top.begin(), top.end(), more_bytes);
+				top.back() = summary;
+				std::push_heap(top.begin(), top.end(), more_bytes);
+			}
+		}
+
+		std::sort_heap(top.begin(), top.end(), more_bytes);
+		for (vector<flow_summary>::const_iterator it = top.begin(); it != top.end(); ++it)
+		{
+			format_summary(out, *it);
+		}
+	}
+	else if (strcmp(query, "snapshot") == 0)
+	{
+		for (uint32_t i = 0; i < count; ++i)
+		{
+			summaries.read(i, summary);
+			format_summary(out, summary);
+		}
+	}
+	else
+	{
+		out += "error: unknown query\n";
+	}
+}
+
+
+
+/*
+ * A connected client and the partial query it sent so far
+ */
+struct client
+{
+	int fd;
+	time_t active;			// last time the client sent anything
+	size_t len;				// length of the partial query
+	char buf[QUERY_MAX_LEN];
+};
+
+
+
+/*
+ * Read from a client and answer the queries it completed.
+ * Returns false when the client is done.
+ */
+static bool serve_client(const query_server& server, client& c)
+{
+	ssize_t n = recv(c.fd, c.buf + c.len, sizeof(c.buf) - c.len, 0);
+	if (n < 0 && errno == EINTR)
+		return true;
+	if (n <= 0)
+		return false;
+
+	c.len += n;
+	c.active = time(NULL);
+
+	char* line = c.buf;
+	char* eol;
+	while ((eol = (char*) memchr(line, '\n', c.buf + c.len - line)) != NULL)
+	{
+		*eol = '\0';
+		if (eol > line && eol[-1] == '\r')
+			eol[-1] = '\0';
+
+		string out;
+		answer(out, *server.summaries, line);
+		out += "\n";
+
+		if (!send_all(c.fd, out))
+			return false;
+
+		line = eol + 1;
+	}
+
+	c.len -= line - c.buf;
+	memmove(c.buf, line, c.len);
+
+	if (c.len == sizeof(c.buf))
+	{
+		send_all(c.fd, "error: query too long\n\n");
+		return false;
+	}
+
+	return true;
+}
+
+
+
+/*
+ * Accept clients and answer their queries as they arrive, so a slow or idle
+ * client doesn't hold up the others
+ */
+static void* serve(void* arg)
+{
+	const query_server& server = *((const query_server*) arg);
+	vector<client*> clients;
+	vector<pollfd> fds;
+
+	while (true)
+	{
+		// The wakeup pipe and the socket come first, then the clients in order
+		fds.resize(2 + clients.size());
+		fds[0].fd = server.wakeup[0];
+		fds[0].events = POLLIN;
+		fds[1].fd = server.fd;
+		fds[1].events = clients.size() < QUERY_MAX_CLIENTS ? POLLIN : 0;
+		for (size_t i = 0; i < clients.size(); ++i)
+		{
+			fds[2 + i].fd = clients[i]->fd;
+			fds[2 + i].events = POLLIN;
+		}
+
+		if (poll(&fds[0], fds.size(), 1000) < 0 && errno != EINTR)
+			break;
+
+		if (fds[0].revents != 0)
+			break;
+
+		// Serve the clients, and drop those that are done or idle for too long
+		time_t now = time(NULL);
+		for (size_t i = clients.size(); i-- > 0; )
+		{
+			client* c = clients[i];
+			bool keep = fds[2 + i].revents != 0 ? serve_client(server, *c) : now - c->active < QUERY_IDLE_TIMEOUT;
+
+			if (!keep)
+			{
+				close(c->fd);
+				delete c;
+				clients.erase(clients.begin() + i);
+			}
+		}
+
+		if (fds[1].revents != 0)
+		{
+			int fd = accept(server.fd, NULL, NULL);
+			if (fd >= 0)
+			{
+				// A client that stops reading its response is dropped
+				timeval timeout;
+				timeout.tv_sec = QUERY_SEND_TIMEOUT;
+				timeout.tv_usec = 0;
+				setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+				client* c = new client;
+				c->fd = fd;
+				c->active = now;
+				c->len = 0;
+				clients.push_back(c);
+			}
+		}
+	}
+
+	for (size_t i = 0; i < clients.size(); ++i)
+	{
+		close(clients[i]->fd);
+		delete clients[i];
+	}
+
+	return NULL;
+}
+
+
+
+query_server* start_query_server(const char* path, const registry& summaries)
+{
+	sockaddr_un addr;
+
+	if (strlen(path) >= sizeof(addr.sun_path))
+	{
+		throw std::runtime_error(string(path) + ": socket path too long");
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0)
+	{
+		throw std::runtime_error(string(path) + ": " + strerror(errno));
+	}
+
+	if (bind(fd, (sockaddr*) &addr, sizeof(addr)) != 0 || listen(fd, 8) != 0)
+	{
+		string error = string(path) + ": " + strerror(errno);
+		close(fd);
+		throw std::runtime_error(error);
+	}
+
+	query_server* server = new query_server;
+	server->path = path;
+	server->summaries = &summaries;
+	server->fd = fd;
+
+	if (pipe(server->wakeup) != 0)
+	{
+		server->wakeup[0] = -1;
+	}
+
+	if (server->wakeup[0] < 0 || pthread_create(&server->thread, NULL, serve, server) != 0)
+	{
+		if (server->wakeup[0] >= 0)
+		{
+			close(server->wakeup[0]);
+			close(server->wakeup[1]);
+		}
+		close(fd);
+		unlink(path);
+		delete server;
+		throw std::runtime_error(string(path) + ": unable to start query server");
+	}
+
+	return server;
+}
+
+
+
+void stop_query_server(query_server* server)
+{
+	// Wake the server thread up, it drops its clients on the way out
+	char stop = 0;
+	while (write(server->wakeup[1], &stop, 1) < 0 && errno == EINTR)
+		;
+	pthread_join(server->thread, NULL);
+
+	close(server->wakeup[0]);
+	close(server->wakeup[1]);
+	close(server->fd);
+	unlink(server->path.c_str());
+	delete server;
+}
@@ -0,0 +1,31 @@
+#ifndef __DAEMON_H__
+#define __DAEMON_H__
+
+#include "registry.h"
+
+
+
+/*
+ * Serve queries over the flow summaries published to a registry on a Unix
+ * domain socket.
+ *
+ * Queries are answered on a separate thread from the registry alone, so they
+ * never block ingestion. Clients are served as their queries arrive, and are
+ * dropped after a minute without a query. Each query is a single line, and
+ * each response is terminated by an empty line:
+ *
+ *   flow ADDR:PORT-ADDR:PORT   summaries of both directions of a connection
+ *   top K                      the K flows that have sent the most bytes
+ *   snapshot                   summaries of all flows
+ *
+ * Several servers may run at once, each on its own socket. Returns the
+ * server, to be stopped with stop_query_server(). Throws std::runtime_error
+ * if the socket can't be created.
+ */
+struct query_server;
+query_server* start_query_server(const char* socket_path, const registry& summaries);
+
+/* Stop serving queries, remove the socket and free the server */
+void stop_query_server(query_server* server);
+
+#endif
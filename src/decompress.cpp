@@ -0,0 +1,633 @@
+#include "decompress.h"
+#include <stdexcept>
+#include <string>
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <map>
+#include <tr1/cstdint>
+#include <pthread.h>
+#include <poll.h>
+#include <unistd.h>
+#include <zlib.h>
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+
+using std::string;
+
+
+/*
+ * Size of each of the two decompressed blocks handed to the reader
+ */
+#define BLOCK_SIZE (1 << 20)
+
+/*
+ * Size of the buffer holding compressed input
+ */
+#define INPUT_SIZE (1 << 17)
+
+
+
+/*
+ * Supported compression formats
+ */
+enum format
+{
+	PLAIN,
+	GZIP,
+	ZSTD
+};
+
+
+
+/*
+ * A watch on a stream, calling back when a read waits for data
+ */
+struct watch
+{
+	uint64_t timeout;		// how long a read waits before calling back (usecs, 0 if not watched)
+	void (*quiet)(void*);
+	void* arg;
+};
+
+
+
+/*
+ * The watches of the streams that may wait for data, by stream
+ */
+static std::map<FILE*, watch*> watches;
+static pthread_mutex_t watches_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+
+/*
+ * A block of decompressed data
+ */
+struct block
+{
+	char data[BLOCK_SIZE];
+	size_t len;			// number of valid bytes in data
+	bool full;			// set by the decompressor, cleared by the reader
+};
+
+
+
+/*
+ * A decompressed stream, double-buffered between the decompressor thread and
+ * the reader.
+ */
+struct stream
+{
+	FILE* source;			// the compressed file
+	format fmt;				// compression format of the source
+	pthread_t thread;		// the decompressor thread
+
+	pthread_mutex_t lock;	// protects the flags below
+	pthread_cond_t cond;	// signalled when a block is filled or released
+	bool done;				// the decompressor has finished
+	bool failed;			// the decompressor hit an error
+	bool stop;				// the reader has closed the stream
+
+	block blocks[2];
+	unsigned curr;			// block currently being read
+	size_t pos;				// read position in the current block
+
+	FILE* reader;			// the stream read from
+	watch idle;
+};
+
+
+
+/*
+ * Wait for block to be released by the reader.
+ * Returns false if the stream is being closed.
+ */
+static bool acquire(stream* s, block& b)
+{
+	pthread_mutex_lock(&s->lock);
+	while (b.full && !s->stop)
+	{
+		pthread_cond_wait(&s->cond, &s->lock);
+	}
+	bool stop = s->stop;
+	pthread_mutex_unlock(&s->lock);
+
+	b.len = 0;
+	return !stop;
+}
+
+
+
+/*
+ * Hand a filled block over to the reader.
+ */
+static void release(stream* s, block& b)
+{
+	pthread_mutex_lock(&s->lock);
+	b.full = true;
+	pthread_cond_broadcast(&s->cond);
+	pthread_mutex_unlock(&s->lock);
+}
+
+
+
+/*
+ * Check if another gzip member follows the one that just ended, reading
+ * enough input to see its magic bytes.
+ */
+static bool next_member(FILE* source, z_stream& zs, unsigned char* in, size_t size)
+{
+	if (zs.avail_in < 2)
+	{
+		// Keep the unread input at the start of the buffer and top it up
+		memmove(in, zs.next_in, zs.avail_in);
+		zs.next_in = in;
+		zs.avail_in += fread(in + zs.avail_in, 1, size - zs.avail_in, source);
+	}
+
+	return zs.avail_in >= 2 && zs.next_in[0] == 0x1f && zs.next_in[1] == 0x8b;
+}
+
+
+
+/*
+ * Decompress a gzip source into the blocks.
+ * Concatenated gzip members are decompressed as a single stream. Like
+ * gzip -d, data after a member that doesn't start another one (e.g. zero
+ * padding of a tape or disk image) ends the stream instead of failing it.
+ */
+static bool inflate_gzip(stream* s)
+{
+	unsigned char in[INPUT_SIZE];
+	z_stream zs;
+	int status = Z_OK;
+	bool in_member = false;		// a member is started and not yet ended
+	bool ended = false;			// the last member was followed by trailing data
+	bool drained = true;		// the last call stopped for lack of input, not of output space
+	unsigned w = 0;
+
+	memset(&zs, 0, sizeof(zs));
+	if (inflateInit2(&zs, 15 + 32) != Z_OK)
+	{
+		return false;
+	}
+
+	while (acquire(s, s->blocks[w]))
+	{
+		block& b = s->blocks[w];
+
+		while (b.len < BLOCK_SIZE && !ended)
+		{
+			// Output may still be pending when the previous block filled up
+			if (zs.avail_in == 0 && drained)
+			{
+				zs.avail_in = fread(in, 1, sizeof(in), s->source);
+				zs.next_in = in;
+				if (zs.avail_in == 0)
+					break;
+			}
+
+			zs.next_out = (Bytef*) b.data + b.len;
+			zs.avail_out = BLOCK_SIZE - b.len;
+			status = inflate(&zs, Z_NO_FLUSH);
+			b.len = BLOCK_SIZE - zs.avail_out;
+			drained = zs.avail_out != 0;
+			in_member = status != Z_STREAM_END;
+
+			if (status == Z_STREAM_END)
+			{
+				inflateReset(&zs);
+				ended = !next_member(s->source, zs, in, sizeof(in));
+			}
+			else if (status != Z_OK && status != Z_BUF_ERROR)
+			{
+				inflateEnd(&zs);
+				return false;
+			}
+		}
+
+		if (b.len == 0)
+			break;
+
+		release(s, b);
+		w ^= 1;
+	}
+
+	inflateEnd(&zs);
+
+	// A source ending inside a member is truncated
+	return !ferror(s->source) && !in_member;
+}
+
+
+
+#ifdef HAVE_ZSTD
+/*
+ * Decompress a zstd source into the blocks.
+ */
+static bool inflate_zstd(stream* s)
+{
+	unsigned char in[INPUT_SIZE];
+	ZSTD_DStream* zs;
+	ZSTD_inBuffer input = { in, 0, 0 };
+	size_t status = 0;			// 0 when the last frame is complete
+	bool drained = true;		// the last call stopped for lack of input, not of output space
+	unsigned w = 0;
+
+	if ((zs = ZSTD_createDStream()) == NULL || ZSTD_isError(ZSTD_initDStream(zs)))
+	{
+		ZSTD_freeDStream(zs);
+		return false;
+	}
+
+	while (acquire(s, s->blocks[w]))
+	{
+		block& b = s->blocks[w];
+
+		while (b.len < BLOCK_SIZE)
+		{
+			// Output may still be pending when the previous block filled up,
+			// unless that completed the frame: another call would start a new one
+			if (input.pos == input.size && (drained || status == 0))
+			{
+				input.size = fread(in, 1, sizeof(in), s->source);
+				input.pos = 0;
+				if (input.size == 0)
+					break;
+			}
+
+			ZSTD_outBuffer output = { b.data, BLOCK_SIZE, b.len };
+			status = ZSTD_decompressStream(zs, &output, &input);
+			b.len = output.pos;
+			drained = output.pos < output.size;
+
+			if (ZSTD_isError(status))
+			{
+				ZSTD_freeDStream(zs);
+				return false;
+			}
+		}
+
+		if (b.len == 0)
+			break;
+
+		release(s, b);
+		w ^= 1;
+	}
+
+	ZSTD_freeDStream(zs);
+
+	// A source ending inside a frame is truncated
+	return !ferror(s->source) && status == 0;
+}
+#endif
+
+
+
+/*
+ * Decompressor thread.
+ */
+static void* decompress(void* arg)
+{
+	stream* s = (stream*) arg;
+#ifdef HAVE_ZSTD
+	bool success = s->fmt == GZIP ? inflate_gzip(s) : inflate_zstd(s);
+#else
+	bool success = inflate_gzip(s);
+#endif
+
+	pthread_mutex_lock(&s->lock);
+	s->done = true;
+	s->failed = !success;
+	pthread_cond_broadcast(&s->cond);
+	pthread_mutex_unlock(&s->lock);
+
+	return NULL;
+}
+
+
+
+/*
+ * Stream read callback, copies from the blocks filled by the decompressor.
+ */
+static ssize_t read_stream(void* cookie, char* buf, size_t size)
+{
+	stream* s = (stream*) cookie;
+	size_t copied = 0;
+
+	while (copied < size)
+	{
+		block& b = s->blocks[s->curr];
+
+		pthread_mutex_lock(&s->lock);
+		if (!b.full && !s->done && s->idle.timeout != 0)
+		{
+			timespec deadline;
+			clock_gettime(CLOCK_REALTIME, &deadline);
+			deadline.tv_nsec += (s->idle.timeout % 1000000) * 1000;
+			deadline.tv_sec += s->idle.timeout / 1000000 + deadline.tv_nsec / 1000000000;
+			deadline.tv_nsec %= 1000000000;
+
+			while (!b.full && !s->done && pthread_cond_timedwait(&s->cond, &s->lock, &deadline) != ETIMEDOUT)
+				;
+
+			if (!b.full && !s->done)
+			{
+				pthread_mutex_unlock(&s->lock);
+				s->idle.quiet(s->idle.arg);
+				pthread_mutex_lock(&s->lock);
+			}
+		}
+		while (!b.full && !s->done)
+		{
+			pthread_cond_wait(&s->cond, &s->lock);
+		}
+		bool full = b.full;
+		bool failed = s->failed;
+		pthread_mutex_unlock(&s->lock);
+
+		if (!full)
+		{
+			if (failed && copied == 0)
+			{
+				errno = EIO;
+				return -1;
+			}
+			break;
+		}
+
+		size_t len = b.len - s->pos < size - copied ? b.len - s->pos : size - copied;
+		memcpy(buf + copied, b.data + s->pos, len);
+		copied += len;
+		s->pos += len;
+
+		if (s->pos == b.len)
+		{
+			// Give the block back to the decompressor
+			s->pos = 0;
+			s->curr ^= 1;
+			pthread_mutex_lock(&s->lock);
+			b.full = false;
+			pthread_cond_broadcast(&s->cond);
+			pthread_mutex_unlock(&s->lock);
+		}
+	}
+
+	return copied;
+}
+
+
+
+/*
+ * Stream close callback, stops the decompressor and releases resources.
+ */
+static int close_stream(void* cookie)
+{
+	stream* s = (stream*) cookie;
+
+	pthread_mutex_lock(&watches_lock);
+	watches.erase(s->reader);
+	pthread_mutex_unlock(&watches_lock);
+
+	pthread_mutex_lock(&s->lock);
+	s->stop = true;
+	pthread_cond_broadcast(&s->cond);
+	pthread_mutex_unlock(&s->lock);
+
+	pthread_join(s->thread, NULL);
+	pthread_cond_destroy(&s->cond);
+	pthread_mutex_destroy(&s->lock);
+
+	int status = fclose(s->source);
+	delete s;
+	return status;
+}
+
+
+
+/*
+ * A stream that can't be rewound, with the bytes peeked from it put back in
+ * front of the rest. The source is read unbuffered, so a read only waits
+ * when no data has arrived.
+ */
+struct replay
+{
+	FILE* source;
+	int fd;					// descriptor of the source
+	unsigned char peeked[4];
+	size_t len;				// number of peeked bytes
+	size_t pos;				// read position in the peeked bytes
+
+	FILE* reader;			// the stream read from
+	watch idle;
+};
+
+
+
+/*
+ * Replay stream read callback, copies the peeked bytes before the source.
+ */
+static ssize_t read_replay(void* cookie, char* buf, size_t size)
+{
+	replay* r = (replay*) cookie;
+	size_t copied = 0;
+
+	while (r->pos < r->len && copied < size)
+	{
+		buf[copied++] = r->peeked[r->pos++];
+	}
+
+	if (copied > 0)
+	{
+		return copied;
+	}
+
+	if (r->idle.timeout != 0)
+	{
+		pollfd p;
+		p.fd = r->fd;
+		p.events = POLLIN;
+
+		if (poll(&p, 1, (r->idle.timeout + 999) / 1000) == 0)
+		{
+			r->idle.quiet(r->idle.arg);
+		}
+	}
+
+	// An interrupted read fails, so reading can be stopped
+	return read(r->fd, buf, size);
+}
+
+
+
+/*
+ * Replay stream close callback.
+ */
+static int close_replay(void* cookie)
+{
+	replay* r = (replay*) cookie;
+
+	pthread_mutex_lock(&watches_lock);
+	watches.erase(r->reader);
+	pthread_mutex_unlock(&watches_lock);
+
+	int status = fclose(r->source);
+	delete r;
+	return status;
+}
+
+
+
+/*
+ * Identify the compression format from the first bytes of a file.
+ * Returns the stream to read the whole file from, which is a replay of the
+ * peeked bytes if the file can't be rewound (a pipe or standard input).
+ */
+static FILE* detect(FILE* fp, format& fmt)
+{
+	unsigned char magic[4];
+	size_t len = 0;
+	bool seekable = lseek(fileno(fp), 0, SEEK_CUR) >= 0;
+
+	if (seekable)
+	{
+		len = fread(magic, 1, sizeof(magic), fp);
+	}
+	else
+	{
+		// Peek around the stdio buffer, the replay reads the descriptor
+		ssize_t n;
+		while (len < sizeof(magic) && ((n = read(fileno(fp), magic + len, sizeof(magic) - len)) > 0 || (n < 0 && errno == EINTR)))
+		{
+			if (n > 0)
+				len += n;
+		}
+	}
+
+	if (len >= 2 && magic[0] == 0x1f && magic[1] == 0x8b)
+		fmt = GZIP;
+	else if (len >= 4 && magic[0] == 0x28 && magic[1] == 0xb5 && magic[2] == 0x2f && magic[3] == 0xfd)
+		fmt = ZSTD;
+	else
+		fmt = PLAIN;
+
+	if (seekable && fseek(fp, 0, SEEK_SET) == 0)
+	{
+		return fp;
+	}
+
+	replay* r = new replay;
+	r->source = fp;
+	r->fd = fileno(fp);
+	memcpy(r->peeked, magic, len);
+	r->len = len;
+	r->pos = 0;
+	r->idle.timeout = 0;
+
+	cookie_io_functions_t funcs;
+	funcs.read = read_replay;
+	funcs.write = NULL;
+	funcs.seek = NULL;
+	funcs.close = close_replay;
+
+	FILE* reader = fopencookie(r, "r", funcs);
+	if (reader == NULL)
+	{
+		delete r;
+		fclose(fp);
+		throw std::runtime_error(string("Unable to read trace: ") + strerror(errno));
+	}
+
+	r->reader = reader;
+	pthread_mutex_lock(&watches_lock);
+	watches[reader] = &r->idle;
+	pthread_mutex_unlock(&watches_lock);
+
+	return reader;
+}
+
+
+
+FILE* open_trace(const char* filename)
+{
+	// Live captures are piped in, e.g. from tcpdump -w -
+	FILE* fp = strcmp(filename, "-") == 0 ? stdin : fopen(filename, "r");
+	if (fp == NULL)
+	{
+		throw std::runtime_error(string(filename) + ": " + strerror(errno));
+	}
+
+	format fmt;
+	fp = detect(fp, fmt);
+	if (fmt == PLAIN)
+	{
+		return fp;
+	}
+
+#ifndef HAVE_ZSTD
+	if (fmt == ZSTD)
+	{
+		fclose(fp);
+		throw std::runtime_error(string(filename) + ": zstd compressed traces are not supported by this build");
+	}
+#endif
+
+	stream* s = new stream;
+	s->source = fp;
+	s->fmt = fmt;
+	s->done = s->failed = s->stop = false;
+	s->blocks[0].full = s->blocks[1].full = false;
+	s->blocks[0].len = s->blocks[1].len = 0;
+	s->curr = 0;
+	s->pos = 0;
+	s->reader = NULL;
+	s->idle.timeout = 0;
+	pthread_mutex_init(&s->lock, NULL);
+	pthread_cond_init(&s->cond, NULL);
+
+	cookie_io_functions_t funcs;
+	funcs.read = read_stream;
+	funcs.write = NULL;
+	funcs.seek = NULL;
+	funcs.close = close_stream;
+
+	if (pthread_create(&s->thread, NULL, decompress, s) != 0)
+	{
+		pthread_cond_destroy(&s->cond);
+		pthread_mutex_destroy(&s->lock);
+		fclose(fp);
+		delete s;
+		throw std::runtime_error(string(filename) + ": unable to start decompressor");
+	}
+
+	FILE* reader = fopencookie(s, "r", funcs);
+	if (reader == NULL)
+	{
+		close_stream(s);
+		throw std::runtime_error(string(filename) + ": " + strerror(errno));
+	}
+
+	s->reader = reader;
+	pthread_mutex_lock(&watches_lock);
+	watches[reader] = &s->idle;
+	pthread_mutex_unlock(&watches_lock);
+
+	return reader;
+}
+
+
+
+void watch_trace(FILE* fp, uint64_t timeout, void (*quiet)(void*), void* arg)
+{
+	pthread_mutex_lock(&watches_lock);
+	std::map<FILE*, watch*>::iterator it = watches.find(fp);
+	if (it != watches.end())
+	{
+		it->second->timeout = quiet != NULL ? timeout : 0;
+		it->second->quiet = quiet;
+		it->second->arg = arg;
+	}
+	pthread_mutex_unlock(&watches_lock);
+}
@@ -0,0 +1,31 @@
+#ifndef __DECOMPRESS_H__
+#define __DECOMPRESS_H__
+
+#include <cstdio>
+#include <tr1/cstdint>
+
+
+
+/*
+ * Open a trace file for reading.
+ *
+ * Compressed traces (gzip or zstd) are detected by their magic number and
+ * decompressed on a separate thread while the returned stream is read, so
+ * decompression overlaps with analysis and no temporary files are written.
+ * The returned stream is not seekable if the trace is compressed or read
+ * from a pipe. The file name "-" reads a trace from standard input.
+ * Reading a truncated compressed trace fails once its data is exhausted.
+ *
+ * Close the stream with fclose(). Throws std::runtime_error on failure.
+ */
+FILE* open_trace(const char* filename);
+
+/*
+ * Call quiet(arg) on the reading thread when a read from a stream opened by
+ * open_trace() has waited for data for the given time (usecs), before it
+ * waits on. Only pipes and compressed traces wait for data, regular files
+ * are not watched. A NULL callback ends the watch.
+ */
+void watch_trace(FILE* fp, uint64_t timeout, void (*quiet)(void*), void* arg);
+
+#endif
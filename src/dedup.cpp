@@ -0,0 +1,116 @@
+#include "dedup.h"
+#include "flow.h"
+#include <tr1/cstdint>
+#include <netinet/tcp.h>
+
+
+
+/*
+ * Parameters of the 64-bit FNV-1a hash
+ */
+#define FNV_OFFSET ((((uint64_t) 0xcbf29ce4) << 32) | 0x84222325)
+#define FNV_PRIME ((((uint64_t) 1) << 40) | 0x1b3)
+
+
+
+static inline uint64_t fnv1a(uint64_t hash, const uint8_t* data, uint32_t len)
+{
+	for (uint32_t i = 0; i < len; ++i)
+	{
+		hash = (hash ^ data[i]) * FNV_PRIME;
+	}
+
+	return hash;
+}
+
+
+
+/*
+ * Does the TCP header carry a timestamp option
+ */
+static inline bool has_timestamp(const uint8_t* opt, const uint8_t* end)
+{
+	while (opt < end && *opt != TCPOPT_EOL)
+	{
+		if (*opt == TCPOPT_NOP)
+		{
+			++opt;
+			continue;
+		}
+
+		if (opt + 2 > end || opt[1] < 2)
+			return false;
+		if (*opt == TCPOPT_TIMESTAMP)
+			return true;
+		opt += opt[1];
+	}
+
+	return false;
+}
+
+
+
+/*
+ * Hash the fields identifying a packet, which are the same for every copy.
+ * Returns false if they don't tell a copy from a retransmission: without an
+ * IP ID and a TCP timestamp, a retransmitted segment has the same headers.
+ */
+static inline bool packet_hash(const uint8_t* frame, uint32_t caplen, uint64_t& hash)
+{
+	const uint8_t* ip = frame + ETHERNET_FRAME_SIZE;
+	const uint8_t* end = frame + caplen;
+	const uint8_t* tcp = ip + (*ip & 0x0f) * 4;
+	const uint8_t* tcp_end = tcp + 13 <= end ? tcp + ((tcp[12] & 0xf0) >> 4) * 4 : end;
+
+	// Only hash what was captured
+	if (tcp_end > end)
+		tcp_end = end;
+	if (tcp + 20 > tcp_end)
+		return false;
+
+	if (*((uint16_t*) (ip + 4)) == 0 && !has_timestamp(tcp + 20, tcp_end))
+		return false;
+
+	hash = FNV_OFFSET;
+	hash = fnv1a(hash, ip + 2, 4);				// IP length and ID
+	hash = fnv1a(hash, ip + 12, 8);				// IP addresses
+	hash = fnv1a(hash, tcp, 4);					// ports
+	hash = fnv1a(hash, tcp + 4, 8);				// sequence and acknowledgement numbers
+	hash = fnv1a(hash, tcp + 12, tcp_end - tcp - 12);	// flags, window and options
+	return true;
+}
+
+
+
+bool duplicate_filter::duplicate(const timeval& ts, const uint8_t* frame, uint32_t caplen)
+{
+	uint64_t now = USECS(ts);
+
+	// Forget packets that fell out of the window
+	while (!order.empty() && order.front().first + window < now)
+	{
+		packet_map::iterator it = seen.find(order.front().second);
+		if (it != seen.end() && it->second == order.front().first)
+		{
+			seen.erase(it);
+		}
+		order.pop_front();
+	}
+
+	uint64_t hash;
+	if (!packet_hash(frame, caplen, hash))
+	{
+		return false;
+	}
+
+	std::pair<packet_map::iterator, bool> entry = seen.insert(std::make_pair(hash, now));
+
+	if (!entry.second)
+	{
+		++count;
+		return true;
+	}
+
+	order.push_back(std::make_pair(now, hash));
+	return false;
+}
@@ -0,0 +1,48 @@
+#ifndef __DEDUP_H__
+#define __DEDUP_H__
+
+#include <tr1/cstdint>
+#include <tr1/unordered_map>
+#include <deque>
+#include <sys/time.h>
+
+
+
+/*
+ * A filter dropping copies of packets, such as frames delivered more than
+ * once by a mirror (SPAN) port, or a packet captured at several points.
+ *
+ * Packets are identified by a hash of their IP length, IP ID, addresses and
+ * TCP header (ports, sequence and acknowledgement numbers, flags and
+ * options). A retransmission gets a new IP ID and a duplicate ACK a new
+ * timestamp or SACK option, so only true copies match. Packets with neither
+ * an IP ID nor a timestamp option are always kept, since their copies can't
+ * be told from retransmissions. Packets are remembered for a bounded time
+ * window.
+ */
+class duplicate_filter
+{
+	public:
+		inline duplicate_filter(uint64_t window)
+			: window(window), count(0)
+		{
+		};
+
+		/* Is the packet (an Ethernet frame) a copy of one seen within the window */
+		bool duplicate(const timeval& timestamp, const uint8_t* frame, uint32_t caplen);
+
+		/* Number of copies dropped */
+		inline uint64_t dropped() const
+		{
+			return count;
+		};
+
+	private:
+		typedef std::tr1::unordered_map< uint64_t, uint64_t > packet_map;
+		packet_map seen;									// time a packet was first seen, by packet hash
+		std::deque< std::pair<uint64_t, uint64_t> > order;	// (time, packet hash), oldest first
+		uint64_t window;									// how long packets are remembered (usecs)
+		uint64_t count;										// number of copies dropped
+};
+
+#endif
@@ -5,15 +5,12 @@
 #include <tr1/cstdint>
 #include <arpa/inet.h>
 #include <sstream>
+#include <stdexcept>
+#include <cstdio>
 
 using std::vector;
 
 
-/* A map of all connections */
-flow::flow_map flow::connections;
-
-
-
 flow::flow(uint32_t src, uint16_t sport, uint32_t dst, uint16_t dport)
 	: src(src), dst(dst), sport(sport), dport(dport)
 {
@@ -60,42 +57,260 @@ flow& flow::operator=(const flow& rhs)
 
 
 
-bool flow::find_connection(const flow*& conn, flowdata*& data, uint32_t src, uint16_t sport, uint32_t dst, uint16_t dport)
+flow_table::flow_table()
+	: memory_limit(0), memory_used(0), spill_store(NULL), spill_end(0), published(NULL), rollups_table(NULL)
+{
+}
+
+
+
+flow_table::~flow_table()
+{
+	if (spill_store != NULL)
+	{
+		fclose(spill_store);
+	}
+}
+
+
+
+bool flow_table::find_connection(const flow*& sent_conn, flowdata*& sent, const flow*& ackd_conn, flowdata*& ackd, uint32_t src, uint16_t sport, uint32_t dst, uint16_t dport)
 {
 	flow key(src, sport, dst, dport);
+	flow reverse(dst, dport, src, sport);
+
+	// Connections are keyed by the lower of their flows
+	unsigned dir = reverse < key ? 1 : 0;
+	const flow& canonical = dir == 0 ? key : reverse;
+	bool created = false;
 
-	// Try to find flow in the connection map
-	flow_map::iterator f = connections.lower_bound(key);
+	// Try to find connection in the connection map
+	connection_map::iterator c = connections.lower_bound(canonical);
 
-	if (f != connections.end() && !(connections.key_comp()(key, f->first)))
+	if (c == connections.end() || connections.key_comp()(canonical, c->first))
 	{
-		// Flow was found
-		conn = &f->first;
-		data = &f->second;
-		return false;
+		// Connection was not found, we have to create it
+		c = connections.insert(c, connection_map::value_type(canonical, connection(canonical)));
+		created = true;
+	}
+
+	connection& entry = c->second;
+	sent_conn = dir == 0 ? &c->first : &entry.reversed;
+	ackd_conn = dir == 0 ? &entry.reversed : &c->first;
+	sent = &entry.data[dir];
+	ackd = &entry.data[1 - dir];
+
+	if (memory_limit != 0)
+	{
+		for (unsigned side = 0; side < 2; ++side)
+		{
+			flowdata* data = &entry.data[side];
+
+			if (created)
+			{
+				data->lru_pos = lru.insert(lru.begin(), data);
+				account(*data);
+			}
+			else if (data->spilled())
+			{
+				// Bring the flow back into memory
+				data->restore(fileno(spill_store));
+				data->lru_pos = lru.insert(lru.begin(), data);
+				account(*data);
+			}
+			else if (data->lru_pos == lru.end())
+			{
+				// The flow had nothing to spill when it was last evicted
+				data->lru_pos = lru.insert(lru.begin(), data);
+			}
+			else
+			{
+				// Mark the flow as most recently active
+				lru.splice(lru.begin(), lru, data->lru_pos);
+			}
+		}
+	}
+
+	return created;
+}
+
+
+
+void flow_table::erase(const flow& conn)
+{
+	connection_map::iterator c = connections.find(conn.canonical());
+	if (c == connections.end())
+	{
+		return;
+	}
+
+	if (memory_limit != 0)
+	{
+		for (unsigned side = 0; side < 2; ++side)
+		{
+			flowdata& data = c->second.data[side];
+
+			if (!data.spilled() && data.lru_pos != lru.end())
+			{
+				lru.erase(data.lru_pos);
+			}
+			release_slot(data);
+			memory_used -= data.footprint;
+		}
+	}
+
+	connections.erase(c);
+}
+
+
+
+void flow_table::set_memory_limit(uint64_t bytes)
+{
+	if (bytes != 0 && bytes < MEMORY_LIMIT_MIN)
+	{
+		throw std::runtime_error("Memory limit is below the minimum of 64K");
+	}
+
+	if (bytes != 0 && spill_store == NULL)
+	{
+		// The spill store is an anonymous temporary file, removed when closed
+		spill_store = tmpfile();
+		if (spill_store == NULL)
+		{
+			throw std::runtime_error("Unable to create spill store");
+		}
+	}
+
+	memory_limit = bytes;
+}
+
+
+
+void flow_table::account(flowdata& data)
+{
+	uint64_t use = data.memory_use();
+
+	memory_used += use - data.footprint;
+	data.footprint = use;
+}
+
+
+
+void flow_table::enforce_memory_limit()
+{
+	vector<char> image;
+
+	while (memory_used > memory_limit && !lru.empty())
+	{
+		flowdata* data = lru.back();
+		lru.pop_back();
+
+		// Spilling would release nothing, keep the flow resident but unlisted
+		if (data->footprint == 0)
+		{
+			data->lru_pos = lru.end();
+			continue;
+		}
+
+		data->pack(image);
+		data->spill(fileno(spill_store), spill_slot(*data, image.size()), image);
+		account(*data);
+	}
+}
+
+
+
+uint64_t flow_table::spill_slot(flowdata& data, uint64_t len)
+{
+	if (len <= data.spill_cap)
+	{
+		// Spill in place of the previous image
+		return data.spill_off;
+	}
+
+	release_slot(data);
+
+	// Take the smallest free slot that fits, or grow the store with some
+	// room for the flow to grow into
+	std::multimap<uint64_t, uint64_t>::iterator slot = spill_free.lower_bound(len);
+	if (slot != spill_free.end())
+	{
+		data.spill_cap = slot->first;
+		data.spill_off = slot->second;
+		spill_free.erase(slot);
+	}
+	else
+	{
+		data.spill_cap = len + len / 4;
+		data.spill_off = spill_end;
+		spill_end += data.spill_cap;
+	}
+
+	return data.spill_off;
+}
+
+
+
+void flow_table::release_slot(flowdata& data)
+{
+	if (data.spill_cap != 0)
+	{
+		spill_free.insert(std::make_pair(data.spill_cap, data.spill_off));
+		data.spill_cap = 0;
 	}
+}
+
+
 
-	// Flow was not found, we have to create it
-	f = connections.insert(f, flow_map::value_type(key, flowdata()));
-	conn = &f->first;
-	data = &f->second;
-	return true;
+void flow_table::reload(flowdata& data) const
+{
+	data.restore(fileno(spill_store));
+}
+
+
+
+flow_table::iterator flow_table::begin() const
+{
+	iterator it(connections.begin(), connections.end(), 0);
+	it.skip();
+	return it;
+}
+
+
+
+flow_table::iterator flow_table::end() const
+{
+	return iterator(connections.end(), connections.end(), 0);
+}
+
+
+
+uint32_t flow_table::count() const
+{
+	// Both flows of a connection are created together, but a connection
+	// seen in one direction only has one flow with any data
+	uint32_t count = 0;
+	for (connection_map::const_iterator c = connections.begin(); c != connections.end(); ++c)
+	{
+		count += c->second.data[0].seen() + c->second.data[1].seen();
+	}
+	return count;
 }
 
 
 
-uint32_t flow::list_connections(vector<const flow*>& conns, vector<const flowdata*>& fdata)
+flow_table::iterator flow_table::find(const flow& conn) const
 {
-	uint32_t flows = 0;
+	flow reverse = conn.reverse();
+	unsigned dir = reverse < conn ? 1 : 0;
 
-	for (flow_map::iterator it = connections.begin(); it != connections.end(); it++)
+	connection_map::const_iterator c = connections.find(dir == 0 ? conn : reverse);
+	if (c == connections.end() || !c->second.data[dir].seen())
 	{
-		fdata.push_back(&it->second);
-		conns.push_back(&it->first);
-		++flows;
+		return end();
 	}
 
-	return flows;
+	return iterator(c, connections.end(), dir);
 }
 
 
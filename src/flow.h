@@ -3,11 +3,13 @@
 
 #include <tr1/cstdint>
 #include <string>
+#include <cstdio>
 #include <sys/time.h>
 #include <vector>
 #include <map>
 #include <list>
 #include "range.h"
+#include "rtt.h"
 
 
 /*
@@ -20,18 +22,95 @@
 class flowdata;
 
 
+
+/*
+ * Tracking levels, selecting how much state is kept per flow.
+ * Each level has a corresponding policy class below, used to instantiate a
+ * specialized ingestion path at compile time.
+ */
+enum tracking
+{
+	TRACK_COUNTERS,			// byte, retransmission and duplicate ACK counters
+	TRACK_RTT,				// counters and RTT samples from TCP timestamps
+	TRACK_RANGES			// counters, RTT samples and full range history
+};
+
+struct track_counters
+{
+	enum { rtt = false, ranges = false };
+};
+
+struct track_rtt
+{
+	enum { rtt = true, ranges = false };
+};
+
+struct track_ranges
+{
+	enum { rtt = true, ranges = true };
+};
+
+
+
+/*
+ * A retransmission episode is a run of retransmissions of the same kind,
+ * lasting from the first retransmission until all retransmitted data is
+ * acknowledged.
+ */
+struct episode
+{
+	enum kind
+	{
+		FAST,				// fast retransmit after duplicate ACKs
+		TIMEOUT,			// retransmit without preceding duplicate ACKs
+		SPURIOUS			// retransmit of data that was already acknowledged
+	};
+
+	uint64_t start;			// time of the first retransmission (usecs)
+	uint64_t duration;		// time until the episode ended (usecs)
+	uint32_t bytes;			// number of bytes retransmitted
+	kind type;
+
+	inline episode(kind type, uint64_t start)
+		: start(start), duration(0), bytes(0), type(type)
+	{
+	};
+};
+
+/*
+ * Number of most recent retransmission episodes kept per flow, older ones
+ * are folded into per-kind counters
+ */
+#define EPISODE_HISTORY 32
+
+
+
 /* 
  * A flow object represents a one-way connection.
  * A TCP flow will have two corresponding flow objects, one per direction.
+ * The lower of the two is the canonical flow of the connection.
  */
 class flow
 {
 	public:
-		/* Retrieve a connection or create it if it doesn't exist */
-		static bool find_connection(const flow*& flow, flowdata*& data, uint32_t src_addr, uint16_t src_port, uint32_t dst_addr, uint16_t dst_port);
+		/* Connection identifiers, in network byte order */
+		inline uint32_t src_addr() const { return src; };
+		inline uint32_t dst_addr() const { return dst; };
+		inline uint16_t src_port() const { return sport; };
+		inline uint16_t dst_port() const { return dport; };
 
-		/* Get a list of all existing connections */
-		static uint32_t list_connections(std::vector<const flow*>& connections, std::vector<const flowdata*>& data);
+		/* The flow in the opposite direction */
+		inline flow reverse() const
+		{
+			return flow(dst, dport, src, sport);
+		};
+
+		/* The canonical flow of the connection, the lower of the two flows */
+		inline flow canonical() const
+		{
+			flow rev = reverse();
+			return rev < *this ? rev : *this;
+		};
 
 		/* 
 		 * Human readable string identifying the flow.
@@ -63,10 +142,157 @@ class flow
 		uint32_t dst;			// destination IP address
 		uint16_t sport;			// source port
 		uint16_t dport;			// destination port
+};
+
+
+
+class registry;
+class rollup_table;
+struct connection;
+
+
+
+/*
+ * Smallest memory limit of a flow table (bytes). Below it, the flows touched
+ * by every batch of segments no longer fit, and are spilled and reloaded over
+ * and over.
+ */
+#define MEMORY_LIMIT_MIN (64 << 10)
+
+
+
+/*
+ * A flow table holds the flows of one analysis: a map of all connections,
+ * keyed by their canonical flow and holding the flows of both directions,
+ * and the memory accounting and spill store of their data.
+ * Flow tables are independent of each other, so several analyses can run in
+ * the same process.
+ */
+class flow_table
+{
+	public:
+		flow_table();
+		~flow_table();
+
+		/*
+		 * Retrieve a connection or create it if it doesn't exist.
+		 * Gives the flow a segment is sent on and the opposite flow it
+		 * acknowledges, both found with a single lookup.
+		 */
+		bool find_connection(const flow*& sent_conn, flowdata*& sent, const flow*& ackd_conn, flowdata*& ackd, uint32_t src_addr, uint16_t src_port, uint32_t dst_addr, uint16_t dst_port);
+
+		/* Remove a connection, both of its flows and their data */
+		void erase(const flow& conn);
+
+	private:
+		typedef std::map< flow, connection > connection_map;
+
+	public:
+		/*
+		 * Iterate over all flows that sent any segment, the flows of a
+		 * connection in a row. The opposite flow of a connection only
+		 * seen in one direction is skipped.
+		 */
+		class iterator
+		{
+			public:
+				inline const flow& conn() const;
+				inline const flowdata& data() const;
+				inline iterator& operator++();
+				inline bool operator==(const iterator& other) const;
+				inline bool operator!=(const iterator& other) const;
+
+			private:
+				friend class flow_table;
+				connection_map::const_iterator pos;
+				connection_map::const_iterator last;	// end of the connections
+				unsigned dir;	// direction within the connection (0 is canonical)
+
+				inline iterator(connection_map::const_iterator pos, connection_map::const_iterator last, unsigned dir)
+					: pos(pos), last(last), dir(dir)
+				{
+				};
+
+				/* Move past flows that sent nothing */
+				inline void skip();
+		};
+		iterator begin() const;
+		iterator end() const;
 
+		/* Number of flows that sent any segment (walks all connections) */
+		uint32_t count() const;
+
+		/* Find an existing flow, returns end() if it doesn't exist or sent nothing */
+		iterator find(const flow& conn) const;
+
+		/* 
+		 * Limit the (approximate) memory used by the range data and
+		 * retransmission episodes of flows, the part of a flow that can be
+		 * spilled. When the limit is exceeded, that data of the least
+		 * recently active flows is spilled to a temporary file on disk.
+		 * Spilled flows are reloaded when they are looked up again.
+		 * Throws if the limit is below MEMORY_LIMIT_MIN.
+		 */
+		void set_memory_limit(uint64_t bytes);
+		inline bool memory_limited() const
+		{
+			return memory_limit != 0;
+		};
+
+		/* Update the memory use of a flow after it has been modified */
+		void account(flowdata& data);
+
+		/* Spill the least recently active flows until memory use is within the limit */
+		void enforce_memory_limit();
+
+		/* Load the spilled range data of a flow, used for copies of spilled flows */
+		void reload(flowdata& data) const;
+
+		/* Roll up updated flows in a rollup table (NULL to stop) */
+		inline void roll_up(rollup_table* table)
+		{
+			rollups_table = table;
+		};
+		inline rollup_table* rollups() const
+		{
+			return rollups_table;
+		};
+
+		/* Publish summaries of updated flows to a registry (NULL to stop) */
+		inline void publish(registry* summaries)
+		{
+			published = summaries;
+		};
+		inline registry* summaries() const
+		{
+			return published;
+		};
+
+	private:
 		/* Map of existing connections  */
-		typedef std::map< flow, flowdata > flow_map;
-		static flow_map connections;
+		connection_map connections;
+
+		/* Memory accounting and the spill store */
+		typedef std::list< flowdata* > lru_list;
+		lru_list lru;			// flows in memory with data to spill, most recently active first
+		uint64_t memory_limit;	// memory limit (0 means unlimited)
+		uint64_t memory_used;	// estimated memory used by flow data
+		FILE* spill_store;		// the spill store (NULL until a limit is set)
+		uint64_t spill_end;		// end of the spill store
+		std::multimap< uint64_t, uint64_t > spill_free;	// free slots of the spill store, offsets by size
+
+		/* Find a slot in the spill store for the spilled data of a flow */
+		uint64_t spill_slot(flowdata& data, uint64_t len);
+
+		/* Give the spill store slot of a flow back */
+		void release_slot(flowdata& data);
+
+		registry* published;	// registry of flow summaries (NULL if not published)
+		rollup_table* rollups_table;	// rollups of the flows (NULL if not rolled up)
+
+		/* Flow tables are not copyable */
+		flow_table(const flow_table& other);
+		flow_table& operator=(const flow_table& other);
 };
 
 
@@ -77,12 +303,30 @@ class flow
  */
 class flowdata
 {
+	friend class flow_table;
+	friend class registry;
+	friend class rollup_table;
+
 	public:
 		/* Register a sent byte range */
+		template <class policy>
 		void register_sent(uint32_t seqno_start, uint32_t seqno_end, const timeval& timestamp);
 
-		/* Register an acknowledgement (ACK) */
-		void register_ack(uint32_t ackno, const timeval& timestamp);
+		/*
+		 * Register an acknowledgement (ACK), of a segment carrying data_len
+		 * bytes of data in the opposite direction
+		 */
+		template <class policy>
+		void register_ack(uint32_t ackno, uint32_t data_len, const timeval& timestamp);
+
+		/* Register the TCP timestamp (TSval) of a sent data segment */
+		void register_tsval(uint32_t tsval, const timeval& timestamp);
+
+		/*
+		 * Register an echoed TCP timestamp (TSecr).
+		 * Returns true and the RTT sample (usecs) if it gave a sample.
+		 */
+		bool register_tsecr(uint32_t tsecr, const timeval& timestamp, uint64_t& rtt);
 
 		/* Various statistics of raw data */
 		uint32_t total_retrans() const;
@@ -91,16 +335,66 @@ class flowdata
 		uint32_t max_num_dupacks() const;
 		uint64_t unique_bytes_sent() const;
 		uint64_t rtt() const;
+		inline const rttstats& rtt_samples() const
+		{
+			return rtt_data != NULL ? rtt_data->samples : no_samples;
+		};
 		uint64_t duration() const;
 
+		/* Number of byte ranges in the range history */
+		inline size_t range_count() const
+		{
+			return range_history().size();
+		};
+
+		/* Has any segment (data or a bare ACK) been sent on this flow */
+		inline bool seen() const
+		{
+			return rel_seqno_max != UINT64_MAX;
+		};
+
+		/* Statistics from counters, available at every tracking level */
+		inline uint64_t highest_seqno() const
+		{
+			return rel_seqno_max != UINT64_MAX ? rel_seqno_max : 0;
+		};
+		inline uint32_t retrans_count() const
+		{
+			return retrans_segments;
+		};
+		inline uint32_t dupack_count() const
+		{
+			return dupacks_total;
+		};
+
+		/* Is the range data of this flow spilled to disk */
+		inline bool spilled() const
+		{
+			return spill_len != 0;
+		};
+
+		/*
+		 * The most recent retransmission episodes, classified as they
+		 * happen (num_episodes() and episode_bytes() count all of them)
+		 */
+		inline const std::vector<episode>& episodes() const
+		{
+			return retrans;
+		};
+		uint32_t num_episodes(episode::kind type) const;
+		uint64_t episode_bytes(episode::kind type) const;
+
 		/* Ctors, operators and const-correctness stuff */
 		flowdata();
 
 		inline flowdata(const flowdata& other)
+			: rtt_data(NULL), rollup_data(NULL), range_data(NULL), spill_cap(0), footprint(0), slot(UINT32_MAX)
 		{
 			*this = other;
 		};
 
+		~flowdata();
+
 		flowdata& operator=(const flowdata& other);
 
 	private:
@@ -109,27 +403,157 @@ class flowdata
 		uint32_t abs_seqno_max;	// latest absolute sequence number registered (seqno wrapping)
 		uint64_t rel_seqno_max;	// latest relative sequence number registered (seqno wrapping)
 
-		uint32_t abs_ackno_min;	// first absolute acknowledgement number (ackno wrapping)
-		uint32_t abs_ackno_max;	// latest absolute acknowledgement number (ackno wrapping)
 		uint64_t curr_ack;  	// the current highest acknowledged (relative) sequence number
 		uint64_t prev_ack;  	// the previous highest acknowledged (relative) seqno
+		uint32_t dupacks;		// number of duplicate ACKs since the last new ACK
+		uint32_t dupacks_total;	// total number of duplicate ACKs
+		uint32_t retrans_segments;	// total number of retransmitted segments
 
 		timeval ts_first,		// flow duration (first registered segment, and last registered segment)
 				ts_last;
 
+		/* RTT samples from TCP timestamps, only allocated when RTT is tracked */
+		struct rtt_state
+		{
+			tsval_table tsvals;	// TSvals sent and not yet echoed
+			rttstats samples;	// running RTT estimate
+		};
+		rtt_state* rtt_data;
+		static const rttstats no_samples;
+
+		/* Rollup aggregates of this flow, only allocated when rolling up */
+		struct rollup_state;
+		rollup_state* rollup_data;
+
 		/* A map over byte ranges and data about them */
 		typedef std::multimap< range, rangedata > range_map;
-		range_map ranges;
 
-		/* Helper methods to match and split ranges */
-		typedef std::list< rangedata* > range_list;
+		/* Range history, only allocated when ranges are tracked */
+		struct range_state
+		{
+			range_map ranges;
+
+			/* Data aggregated over intervals/time slices */
+			std::vector<uint64_t> throughput;
+			std::vector<uint64_t> goodput;
+			std::vector<uint64_t> latency;
+			std::vector<uint64_t> loss;
+		};
+		range_state* range_data;
+		static const range_map no_ranges;
+
+		inline const range_map& range_history() const
+		{
+			return range_data != NULL ? range_data->ranges : no_ranges;
+		};
+		inline range_map& range_store()
+		{
+			if (range_data == NULL)
+				range_data = new range_state;
+			return range_data->ranges;
+		};
+
+		/* Helper methods to match and split ranges, and to merge them back */
+		typedef std::list< range_map::iterator > range_list;
 		inline void find_and_split_ranges(range_list& list, const range& key, bool include_new_data);
+		inline void coalesce_ranges(const range_list& list);
+
+		/* Spilling range data to disk and reloading it */
+		uint64_t spill_off;		// offset of the slot of the flow in the spill store
+		uint64_t spill_cap;		// size of the slot (0 if the flow has none)
+		uint64_t spill_len;		// length of the spilled range data (0 if not spilled)
+		uint64_t footprint;		// memory use accounted for this flow
+		std::list< flowdata* >::iterator lru_pos;	// position in the LRU list (its end if not listed)
+
+		/* Index of the published summary of this flow (UINT32_MAX if unpublished) */
+		uint32_t slot;
 
-		/* Data aggregated over intervals/time slices */
-		std::vector<uint64_t> throughput;
-		std::vector<uint64_t> goodput;
-		std::vector<uint64_t> latency;
-		std::vector<uint64_t> loss;
+		uint64_t memory_use() const;
+		void pack(std::vector<char>& image) const;
+		void spill(int fd, uint64_t offset, const std::vector<char>& image);
+		void restore(int fd);
+
+		/* Retransmission episodes, at most EPISODE_HISTORY of them */
+		std::vector<episode> retrans;
+		uint32_t folded_episodes[3];	// older episodes per episode::kind, no longer listed
+		uint64_t folded_bytes[3];	// bytes retransmitted in those episodes
+		bool in_episode;		// the last episode is still ongoing
+		uint64_t recover;		// the (relative) seqno that ends the ongoing episode
+
+		/* Helper method to classify a retransmitted byte range */
+		inline void register_retrans(uint64_t rel_start, uint64_t rel_end, const timeval& ts);
 };
 
+
+
+/*
+ * A connection holds the data of both flows of a TCP connection, indexed by
+ * direction (0 is the canonical flow, which is the key of the connection)
+ */
+struct connection
+{
+	flow reversed;			// the flow opposite of the canonical flow
+	flowdata data[2];
+
+	inline connection(const flow& canonical)
+		: reversed(canonical.reverse())
+	{
+	};
+};
+
+
+
+inline const flow& flow_table::iterator::conn() const
+{
+	return dir == 0 ? pos->first : pos->second.reversed;
+}
+
+
+
+inline const flowdata& flow_table::iterator::data() const
+{
+	return pos->second.data[dir];
+}
+
+
+
+inline void flow_table::iterator::skip()
+{
+	while (pos != last && !data().seen())
+	{
+		if (++dir == 2)
+		{
+			++pos;
+			dir = 0;
+		}
+	}
+}
+
+
+
+inline flow_table::iterator& flow_table::iterator::operator++()
+{
+	if (++dir == 2)
+	{
+		++pos;
+		dir = 0;
+	}
+	skip();
+	return *this;
+}
+
+
+
+inline bool flow_table::iterator::operator==(const iterator& other) const
+{
+	return pos == other.pos && dir == other.dir;
+}
+
+
+
+inline bool flow_table::iterator::operator!=(const iterator& other) const
+{
+	return !(*this == other);
+}
+
 #endif
@@ -0,0 +1,275 @@
+#include "index.h"
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <map>
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <tr1/cstdint>
+#include <sys/stat.h>
+
+using std::string;
+using std::vector;
+
+
+/*
+ * Identifies an index file, and its version
+ */
+#define INDEX_MAGIC "TCPSIDX1"
+
+
+
+/*
+ * Header of an index file
+ */
+struct index_header
+{
+	char magic[8];
+	uint64_t trace_size;	// size of the indexed trace file
+	uint64_t trace_mtime;	// modification time of the indexed trace file
+	uint32_t num_times;		// number of time table entries
+	uint32_t num_conns;		// number of connections
+};
+
+
+
+/*
+ * Header of the record offsets of a connection in an index file
+ */
+struct conn_header
+{
+	uint32_t addr_lo, addr_hi;
+	uint16_t port_lo, port_hi;
+	uint32_t count;			// number of offsets
+	uint32_t length;		// length of the encoded offsets
+};
+
+
+
+trace_index::conn_key::conn_key(uint32_t src_addr, uint16_t src_port, uint32_t dst_addr, uint16_t dst_port)
+{
+	if (src_addr < dst_addr || (src_addr == dst_addr && src_port < dst_port))
+	{
+		addr_lo = src_addr; port_lo = src_port;
+		addr_hi = dst_addr; port_hi = dst_port;
+	}
+	else
+	{
+		addr_lo = dst_addr; port_lo = dst_port;
+		addr_hi = src_addr; port_hi = src_port;
+	}
+}
+
+
+
+bool trace_index::conn_key::operator<(const conn_key& rhs) const
+{
+	if (addr_lo != rhs.addr_lo)
+		return addr_lo < rhs.addr_lo;
+	if (addr_hi != rhs.addr_hi)
+		return addr_hi < rhs.addr_hi;
+	if (port_lo != rhs.port_lo)
+		return port_lo < rhs.port_lo;
+	return port_hi < rhs.port_hi;
+}
+
+
+
+void trace_index::add(uint64_t offset, const timeval& ts, uint32_t src, uint16_t sport, uint32_t dst, uint16_t dport)
+{
+	uint64_t second = ((uint64_t) ts.tv_sec) * 1000000;
+
+	// Start a new time table entry every second
+	if (times.empty() || second > times.back().first)
+	{
+		times.push_back(std::make_pair(second, offset));
+	}
+
+	conn_offsets& conn = conns[conn_key(src, sport, dst, dport)];
+	uint64_t delta = offset - conn.last;
+
+	// Varint encode the distance from the previous record
+	while (delta >= 0x80)
+	{
+		conn.deltas.push_back((delta & 0x7f) | 0x80);
+		delta >>= 7;
+	}
+	conn.deltas.push_back(delta);
+
+	conn.last = offset;
+	++conn.count;
+}
+
+
+
+uint64_t trace_index::seek_time(uint64_t time) const
+{
+	// Find the last entry starting at or before the given time
+	vector< std::pair<uint64_t, uint64_t> >::const_iterator it;
+	it = std::upper_bound(times.begin(), times.end(), std::make_pair(time, UINT64_MAX));
+
+	if (it == times.begin())
+	{
+		return times.empty() ? 0 : it->second;
+	}
+
+	return (--it)->second;
+}
+
+
+
+bool trace_index::seek_connection(vector<uint64_t>& offsets, uint32_t src, uint16_t sport, uint32_t dst, uint16_t dport) const
+{
+	conn_map::const_iterator it = conns.find(conn_key(src, sport, dst, dport));
+	if (it == conns.end())
+	{
+		return false;
+	}
+
+	const vector<uint8_t>& deltas = it->second.deltas;
+	uint64_t offset = 0;
+	uint64_t delta = 0;
+	unsigned shift = 0;
+
+	offsets.reserve(offsets.size() + it->second.count);
+	for (vector<uint8_t>::const_iterator byte = deltas.begin(); byte != deltas.end(); ++byte)
+	{
+		delta |= ((uint64_t) (*byte & 0x7f)) << shift;
+		shift += 7;
+
+		if (!(*byte & 0x80))
+		{
+			offset += delta;
+			offsets.push_back(offset);
+			delta = 0;
+			shift = 0;
+		}
+	}
+
+	return true;
+}
+
+
+
+string trace_index::filename(const string& trace_filename)
+{
+	return trace_filename + ".idx";
+}
+
+
+
+/*
+ * Get size and modification time of a trace file.
+ */
+static void trace_stat(const string& trace_filename, uint64_t& size, uint64_t& mtime)
+{
+	struct stat st;
+
+	if (stat(trace_filename.c_str(), &st) != 0)
+	{
+		throw std::runtime_error(trace_filename + ": " + strerror(errno));
+	}
+
+	size = st.st_size;
+	mtime = st.st_mtime;
+}
+
+
+
+void trace_index::save(const string& trace_filename) const
+{
+	string name = filename(trace_filename);
+	index_header hdr;
+
+	memcpy(hdr.magic, INDEX_MAGIC, sizeof(hdr.magic));
+	trace_stat(trace_filename, hdr.trace_size, hdr.trace_mtime);
+	hdr.num_times = times.size();
+	hdr.num_conns = conns.size();
+
+	FILE* fp = fopen(name.c_str(), "w");
+	if (fp == NULL)
+	{
+		throw std::runtime_error(name + ": " + strerror(errno));
+	}
+
+	bool ok = fwrite(&hdr, sizeof(hdr), 1, fp) == 1;
+
+	if (ok && !times.empty())
+	{
+		ok = fwrite(&times[0], sizeof(times[0]), times.size(), fp) == times.size();
+	}
+
+	for (conn_map::const_iterator it = conns.begin(); ok && it != conns.end(); ++it)
+	{
+		conn_header conn;
+		conn.addr_lo = it->first.addr_lo;
+		conn.addr_hi = it->first.addr_hi;
+		conn.port_lo = it->first.port_lo;
+		conn.port_hi = it->first.port_hi;
+		conn.count = it->second.count;
+		conn.length = it->second.deltas.size();
+
+		ok = fwrite(&conn, sizeof(conn), 1, fp) == 1
+			&& fwrite(&it->second.deltas[0], 1, conn.length, fp) == conn.length;
+	}
+
+	if (fclose(fp) != 0 || !ok)
+	{
+		remove(name.c_str());
+		throw std::runtime_error(name + ": unable to write index");
+	}
+}
+
+
+
+bool trace_index::load(const string& trace_filename)
+{
+	string name = filename(trace_filename);
+	index_header hdr;
+	uint64_t size, mtime;
+
+	FILE* fp = fopen(name.c_str(), "r");
+	if (fp == NULL)
+	{
+		return false;
+	}
+
+	trace_stat(trace_filename, size, mtime);
+
+	if (fread(&hdr, sizeof(hdr), 1, fp) != 1
+			|| memcmp(hdr.magic, INDEX_MAGIC, sizeof(hdr.magic)) != 0
+			|| hdr.trace_size != size || hdr.trace_mtime != mtime)
+	{
+		fclose(fp);
+		return false;
+	}
+
+	times.resize(hdr.num_times);
+	bool ok = hdr.num_times == 0 || fread(&times[0], sizeof(times[0]), times.size(), fp) == times.size();
+
+	conns.clear();
+	for (uint32_t i = 0; ok && i < hdr.num_conns; ++i)
+	{
+		conn_header conn;
+		ok = fread(&conn, sizeof(conn), 1, fp) == 1;
+		if (!ok)
+			break;
+
+		conn_offsets& offsets = conns[conn_key(conn.addr_lo, conn.port_lo, conn.addr_hi, conn.port_hi)];
+		offsets.count = conn.count;
+		offsets.deltas.resize(conn.length);
+		ok = conn.length == 0 || fread(&offsets.deltas[0], 1, conn.length, fp) == conn.length;
+	}
+
+	fclose(fp);
+
+	if (!ok)
+	{
+		times.clear();
+		conns.clear();
+	}
+
+	return ok;
+}
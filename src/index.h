@@ -0,0 +1,72 @@
+#ifndef __INDEX_H__
+#define __INDEX_H__
+
+#include <tr1/cstdint>
+#include <string>
+#include <vector>
+#include <map>
+#include <sys/time.h>
+
+
+
+/*
+ * A sidecar index of a trace file, mapping time to file offsets and
+ * connections to the offsets of their records. The index is stored next to
+ * the trace (trace file name + ".idx") and lets later runs seek straight to
+ * the records of a single connection or a time window.
+ */
+class trace_index
+{
+	public:
+		/* Add a record to the index */
+		void add(uint64_t offset, const timeval& timestamp, uint32_t src_addr, uint16_t src_port, uint32_t dst_addr, uint16_t dst_port);
+
+		/* Offset of the first record at or before the given time (usecs) */
+		uint64_t seek_time(uint64_t time) const;
+
+		/*
+		 * Get the offsets of all records of a connection, in either direction.
+		 * Returns false if the connection is not in the index.
+		 */
+		bool seek_connection(std::vector<uint64_t>& offsets, uint32_t src_addr, uint16_t src_port, uint32_t dst_addr, uint16_t dst_port) const;
+
+		/*
+		 * Save or load the index of a trace file.
+		 * Loading fails if there is no index or if it is out of date.
+		 */
+		void save(const std::string& trace_filename) const;
+		bool load(const std::string& trace_filename);
+
+		/* Name of the index file of a trace file */
+		static std::string filename(const std::string& trace_filename);
+
+	private:
+		/* A connection, with the lower endpoint first so both directions share a key */
+		struct conn_key
+		{
+			uint32_t addr_lo, addr_hi;
+			uint16_t port_lo, port_hi;
+
+			conn_key(uint32_t src_addr, uint16_t src_port, uint32_t dst_addr, uint16_t dst_port);
+			bool operator<(const conn_key& other) const;
+		};
+
+		/* Record offsets of a connection, delta and varint encoded */
+		struct conn_offsets
+		{
+			uint64_t last;					// last offset added
+			uint32_t count;					// number of offsets
+			std::vector<uint8_t> deltas;	// encoded differences between offsets
+
+			conn_offsets() : last(0), count(0) {};
+		};
+
+		/* Time table, one entry per second of trace: (usecs, offset) */
+		std::vector< std::pair<uint64_t, uint64_t> > times;
+
+		/* Record offsets per connection */
+		typedef std::map< conn_key, conn_offsets > conn_map;
+		conn_map conns;
+};
+
+#endif
@@ -1,54 +1,545 @@
 #include <stdexcept>
 #include <cstdio>
+#include <cstdlib>
+#include <cstring>
 #include <vector>
+#include <algorithm>
+#include <unistd.h>
+#include <getopt.h>
+#include <signal.h>
+#include <pthread.h>
+#include <time.h>
+#include <tr1/cstdint>
 #include "trace.h"
+#include "decompress.h"
 #include "flow.h"
+#include "report.h"
+#include "registry.h"
+#include "daemon.h"
+#include "rollup.h"
 
 using std::vector;
 
 
 
+/*
+ * How long an interrupted daemon waits for reading to stop, and how often it
+ * interrupts the reading thread meanwhile (usecs)
+ */
+#define STOP_GRACE 1000000
+#define STOP_RETRY 10000
+
+
+
+/*
+ * State shared with the thread taking the signals that end daemon mode
+ */
+struct stopper
+{
+	query_server* server;	// the query server (NULL until it is started)
+	sigset_t signals;		// the signals ending daemon mode
+	pthread_t reader;		// the thread reading the traces
+	pthread_mutex_t lock;	// protects reading
+	pthread_cond_t cond;	// signalled when reading is done
+	bool reading;			// the traces are still being read
+};
+
+
+
+/*
+ * Signal handler that only interrupts a blocking read
+ */
+static void interrupt(int)
+{
+}
+
+
+
+/*
+ * Signal thread of daemon mode.
+ * A signal during reading stops the analysis, so the flows read so far are
+ * reported. If reading can't be interrupted, the socket is removed and the
+ * daemon exits right away.
+ */
+static void* wait_for_stop(void* arg)
+{
+	stopper& stop = *((stopper*) arg);
+	int sig;
+
+	sigwait(&stop.signals, &sig);
+
+	pthread_mutex_lock(&stop.lock);
+	if (stop.reading)
+	{
+		stop_analysis();
+
+		for (unsigned waited = 0; stop.reading && waited < STOP_GRACE; waited += STOP_RETRY)
+		{
+			// Interrupt a read blocked on a quiet stream
+			pthread_kill(stop.reader, SIGUSR1);
+
+			timespec deadline;
+			clock_gettime(CLOCK_REALTIME, &deadline);
+			deadline.tv_nsec += STOP_RETRY * 1000;
+			deadline.tv_sec += deadline.tv_nsec / 1000000000;
+			deadline.tv_nsec %= 1000000000;
+			pthread_cond_timedwait(&stop.cond, &stop.lock, &deadline);
+		}
+
+		if (stop.reading)
+		{
+			fprintf(stderr, "Unable to interrupt reading the trace\n");
+			if (stop.server != NULL)
+				stop_query_server(stop.server);
+			_exit(1);
+		}
+	}
+	pthread_mutex_unlock(&stop.lock);
+
+	return NULL;
+}
+
+
+
+/*
+ * Tell the signal thread that reading is done
+ */
+static void done_reading(stopper& stop)
+{
+	pthread_mutex_lock(&stop.lock);
+	stop.reading = false;
+	pthread_cond_broadcast(&stop.cond);
+	pthread_mutex_unlock(&stop.lock);
+}
+
+
+
+/*
+ * Parse a size with an optional K, M or G suffix.
+ * Returns 0 if the size is invalid.
+ */
+static uint64_t parse_size(const char* str)
+{
+	char* end;
+	uint64_t size = strtoull(str, &end, 10);
+
+	switch (*end)
+	{
+		case 'G': case 'g':
+			size <<= 10;
+			// fall through
+		case 'M': case 'm':
+			size <<= 10;
+			// fall through
+		case 'K': case 'k':
+			size <<= 10;
+			++end;
+	}
+
+	return *end == '\0' ? size : 0;
+}
+
+
+
+/*
+ * Parse a time in (fractional) seconds since the epoch into usecs.
+ * Returns false if the time is invalid.
+ */
+static bool parse_time(const char* str, uint64_t& time)
+{
+	char* end;
+	double secs = strtod(str, &end);
+
+	if (*end != '\0' || secs < 0)
+	{
+		return false;
+	}
+
+	time = (uint64_t) (secs * 1000000);
+	return true;
+}
+
+
+
+/*
+ * Parse a comma separated list of rollup keys: subnet[/LEN], port and pair.
+ * Returns false if a key is invalid.
+ */
+static bool parse_rollup(char* str, rollup_table& rollups)
+{
+	for (char* key = strtok(str, ","); key != NULL; key = strtok(NULL, ","))
+	{
+		unsigned prefix_len = 24;
+		char end;
+
+		if (strcmp(key, "subnet") == 0
+				|| (sscanf(key, "subnet/%u%c", &prefix_len, &end) == 1 && prefix_len <= 32))
+			rollups.enable(ROLLUP_SUBNET, prefix_len);
+		else if (strcmp(key, "port") == 0)
+			rollups.enable(ROLLUP_PORT);
+		else if (strcmp(key, "pair") == 0)
+			rollups.enable(ROLLUP_PAIR);
+		else
+			return false;
+	}
+
+	return true;
+}
+
+
+
+/*
+ * Print the aggregates of a rollup key, in key order
+ */
+static void print_rollup(const rollup_table& rollups, rollup_key key, const char* title)
+{
+	typedef rollup_table::aggregate_map::const_iterator entry;
+	const rollup_table::aggregate_map& aggregates = rollups.aggregates(key);
+	vector< std::pair<uint64_t, const aggregate*> > sorted;
+
+	for (entry it = aggregates.begin(); it != aggregates.end(); ++it)
+	{
+		sorted.push_back(std::make_pair(it->first, &it->second));
+	}
+	std::sort(sorted.begin(), sorted.end());
+
+	printf("Rollup by %s: %lu entries\n\n", title, sorted.size());
+
+	for (unsigned i = 0; i < sorted.size(); ++i)
+	{
+		std::string id = rollups.key_str(key, sorted[i].first);
+		const aggregate& agg = *sorted[i].second;
+
+		printf("%s has %lu connections\n", id.c_str(), agg.connections);
+		printf("%s has sent %lu bytes\n", id.c_str(), agg.bytes);
+		printf("%s has %lu retransmissions\n", id.c_str(), agg.retrans);
+		printf("%s has %lu dupacks\n", id.c_str(), agg.dupacks);
+
+		uint64_t samples = 0;
+		for (unsigned bucket = 0; bucket < RTT_BUCKETS; ++bucket)
+		{
+			samples += agg.rtt[bucket];
+		}
+
+		if (samples > 0)
+		{
+			printf("%s has RTT histogram", id.c_str());
+			for (unsigned bucket = 0; bucket < RTT_BUCKETS; ++bucket)
+			{
+				if (agg.rtt[bucket] == 0)
+					continue;
+
+				if (bucket < RTT_BUCKETS - 1)
+					printf(" <%.2fms:%lu", rollup_table::bucket_bound(bucket) / 1000.0, agg.rtt[bucket]);
+				else
+					printf(" >=%.2fms:%lu", rollup_table::bucket_bound(bucket - 1) / 1000.0, agg.rtt[bucket]);
+			}
+			printf("\n");
+		}
+		printf("\n");
+	}
+}
+
+
+
+static void usage(const char* name)
+{
+	fprintf(stderr, "Usage: %s [options] tracefile...\n", name);
+	fprintf(stderr, "Multiple trace files are merged by timestamp and analyzed as one trace.\n");
+	fprintf(stderr, "Use - as tracefile to read from standard input, e.g. tcpdump -w - | %s -d SOCKET -\n\n", name);
+	fprintf(stderr, "Options:\n");
+	fprintf(stderr, "  -m, --max-memory=SIZE   limit memory used by range data to SIZE bytes (K, M or G suffix,\n");
+	fprintf(stderr, "                          at least 64K), spilling the least recently active flows to disk\n");
+	fprintf(stderr, "  -f, --flow=CONN         only analyze the connection ADDR:PORT-ADDR:PORT\n");
+	fprintf(stderr, "  -s, --start=TIME        only analyze packets from TIME (seconds since the epoch)\n");
+	fprintf(stderr, "  -e, --end=TIME          only analyze packets until TIME (seconds since the epoch)\n");
+	fprintf(stderr, "  -t, --track=LEVEL       per-flow state to keep: 'counters', 'rtt' (counters and RTT\n");
+	fprintf(stderr, "                          samples) or 'ranges' (full range history, the default)\n");
+	fprintf(stderr, "  -x, --index             write an index next to the trace, used by later runs\n");
+	fprintf(stderr, "                          with --flow, --start or --end to seek to the packets\n");
+	fprintf(stderr, "  -u, --dedup=WINDOW      drop copies of packets seen within WINDOW seconds, e.g. frames\n");
+	fprintf(stderr, "                          mirrored twice or captured at both endpoints\n");
+	fprintf(stderr, "  -r, --rollup=KEYS       report aggregates instead of flows, by the comma separated\n");
+	fprintf(stderr, "                          keys 'subnet[/LEN]' (client subnet, /24 by default), 'port'\n");
+	fprintf(stderr, "                          (server port) and 'pair' (client and server address),\n");
+	fprintf(stderr, "                          tracking at the 'rtt' level unless --track=counters\n");
+	fprintf(stderr, "  -d, --daemon=SOCKET     answer queries about live flow state on the Unix socket\n");
+	fprintf(stderr, "                          SOCKET while analyzing, and until interrupted afterwards\n");
+}
+
+
+
 int main(int argc, char** argv)
 {
-	if (argc < 2)
+	static const option options[] = {
+		{ "max-memory", required_argument, NULL, 'm' },
+		{ "flow", required_argument, NULL, 'f' },
+		{ "start", required_argument, NULL, 's' },
+		{ "end", required_argument, NULL, 'e' },
+		{ "track", required_argument, NULL, 't' },
+		{ "index", no_argument, NULL, 'x' },
+		{ "dedup", required_argument, NULL, 'u' },
+		{ "rollup", required_argument, NULL, 'r' },
+		{ "daemon", required_argument, NULL, 'd' },
+		{ NULL, 0, NULL, 0 }
+	};
+
+	uint64_t max_memory = 0;
+	bool build_index = false;
+	const char* socket_path = NULL;
+	rollup_table rollups;
+	bool roll_up = false;
+	tracking level = TRACK_RANGES;
+	bool level_given = false;
+	filter f;
+	int opt;
+
+	while ((opt = getopt_long(argc, argv, "m:f:s:e:t:xu:r:d:", options, NULL)) != -1)
 	{
-		fprintf(stderr, "Usage: %s tracefile\n", argv[0]);
+		switch (opt)
+		{
+			case 'm':
+				if ((max_memory = parse_size(optarg)) == 0)
+				{
+					fprintf(stderr, "Invalid memory size: %s\n", optarg);
+					return 1;
+				}
+				break;
+
+			case 'f':
+				if (!f.parse_connection(optarg))
+				{
+					fprintf(stderr, "Invalid connection: %s\n", optarg);
+					return 1;
+				}
+				break;
+
+			case 's':
+				if (!parse_time(optarg, f.start))
+				{
+					fprintf(stderr, "Invalid start time: %s\n", optarg);
+					return 1;
+				}
+				break;
+
+			case 'e':
+				if (!parse_time(optarg, f.end))
+				{
+					fprintf(stderr, "Invalid end time: %s\n", optarg);
+					return 1;
+				}
+				break;
+
+			case 't':
+				if (strcmp(optarg, "counters") == 0)
+					level = TRACK_COUNTERS;
+				else if (strcmp(optarg, "rtt") == 0)
+					level = TRACK_RTT;
+				else if (strcmp(optarg, "ranges") == 0)
+					level = TRACK_RANGES;
+				else
+				{
+					fprintf(stderr, "Invalid tracking level: %s\n", optarg);
+					return 1;
+				}
+				level_given = true;
+				break;
+
+			case 'x':
+				build_index = true;
+				break;
+
+			case 'u':
+				if (!parse_time(optarg, f.dedup_window) || f.dedup_window == 0)
+				{
+					fprintf(stderr, "Invalid deduplication window: %s\n", optarg);
+					return 1;
+				}
+				break;
+
+			case 'r':
+				if (!parse_rollup(optarg, rollups))
+				{
+					fprintf(stderr, "Invalid rollup keys: %s\n", optarg);
+					return 1;
+				}
+				roll_up = true;
+				break;
+
+			case 'd':
+				socket_path = optarg;
+				break;
+
+			default:
+				usage(argv[0]);
+				return 1;
+		}
+	}
+
+	if (optind == argc || (build_index && optind != argc - 1))
+	{
+		usage(argv[0]);
 		return 1;
 	}
 
-	filter f;
+	// Rollups need no range history
+	if (roll_up && !level_given)
+	{
+		level = TRACK_RTT;
+	}
+	else if (roll_up && level == TRACK_RANGES)
+	{
+		fprintf(stderr, "Rollups keep no range history, use --track=rtt or --track=counters\n");
+		return 1;
+	}
+
+	flow_table flows;
+	registry summaries;
+	vector<flowstats> stats;
+	uint64_t duplicates = 0;
+
+	// Signals ending daemon mode are taken by a signal thread, so block them before any thread is started
+	stopper stop;
+	pthread_t stop_thread;
+	stop.server = NULL;
+	stop.reader = pthread_self();
+	stop.reading = true;
+	sigemptyset(&stop.signals);
+	sigaddset(&stop.signals, SIGINT);
+	sigaddset(&stop.signals, SIGTERM);
+	pthread_mutex_init(&stop.lock, NULL);
+	pthread_cond_init(&stop.cond, NULL);
+
+	if (socket_path != NULL)
+	{
+		struct sigaction action;
+		memset(&action, 0, sizeof(action));
+		action.sa_handler = interrupt;
+		sigemptyset(&action.sa_mask);
+		sigaction(SIGUSR1, &action, NULL);
+
+		pthread_sigmask(SIG_BLOCK, &stop.signals, NULL);
+		if (pthread_create(&stop_thread, NULL, wait_for_stop, &stop) != 0)
+		{
+			fprintf(stderr, "Unable to start signal thread\n");
+			return 2;
+		}
+	}
 
 	try
 	{
-		FILE* fp = fopen(argv[1], "r");
-		analyze_trace(fp, f);
-		fclose(fp);
+		trace_index index;
+
+		flows.set_memory_limit(max_memory);
+
+		if (roll_up)
+		{
+			flows.roll_up(&rollups);
+		}
+
+		if (socket_path != NULL)
+		{
+			flows.publish(&summaries);
+
+			query_server* server = start_query_server(socket_path, summaries);
+			pthread_mutex_lock(&stop.lock);
+			stop.server = server;
+			pthread_mutex_unlock(&stop.lock);
+		}
+
+		vector<FILE*> files;
+		for (int i = optind; i < argc; ++i)
+		{
+			files.push_back(open_trace(argv[i]));
+		}
+
+		if (build_index)
+		{
+			index_trace(flows, files[0], f, level, index);
+			index.save(argv[optind]);
+		}
+		else if (files.size() == 1 && (f.single_connection() || f.start > 0) && index.load(argv[optind]))
+		{
+			duplicates = analyze_trace(flows, files, f, level, &index);
+		}
+		else
+		{
+			duplicates = analyze_trace(flows, files, f, level);
+		}
+
+		for (vector<FILE*>::iterator it = files.begin(); it != files.end(); ++it)
+		{
+			fclose(*it);
+		}
+
+		done_reading(stop);
+
+		// Rollups are maintained during ingestion, flows are only needed without them
+		if (!roll_up)
+		{
+			finalize_stats(flows, stats, level, sysconf(_SC_NPROCESSORS_ONLN));
+		}
 	}
 	catch (const std::runtime_error& e)
 	{
 		fprintf(stderr, "Unexpected error: %s\n", e.what());
+		if (socket_path != NULL)
+		{
+			done_reading(stop);
+			if (stop.server != NULL)
+				stop_query_server(stop.server);
+		}
 		return 2;
 	}
 
-	vector<const flow*> connections;
-	vector<const flowdata*> data;
-	
-	unsigned count = flow::list_connections(connections, data);
-	printf("Connections found: %d\n\n", count);
+	if (f.dedup_window != 0)
+		printf("Duplicate packets dropped: %lu\n", duplicates);
+	printf("Connections found: %u\n\n", flows.count());
+
+	if (rollups.enabled(ROLLUP_SUBNET))
+		print_rollup(rollups, ROLLUP_SUBNET, "client subnet");
+	if (rollups.enabled(ROLLUP_PORT))
+		print_rollup(rollups, ROLLUP_PORT, "server port");
+	if (rollups.enabled(ROLLUP_PAIR))
+		print_rollup(rollups, ROLLUP_PAIR, "client and server");
 
-	for (unsigned i = 0; i < count; ++i)
+	for (vector<flowstats>::const_iterator it = stats.begin(); it != stats.end(); ++it)
 	{
-		const flow* f = connections[i];
-		const flowdata* d = data[i];
+		const char* id = it->id.c_str();
 
-		printf("%s has sent %lu unique bytes\n", f->id().c_str(), d->unique_bytes_sent());
-		printf("%s has %u (%u) retransmissions\n", f->id().c_str(), d->total_retrans(), d->max_num_retrans());
-		printf("%s has RTT %.2f ms\n", f->id().c_str(), d->rtt() / 1000.0);
-		printf("%s has %u (%u) dupacks\n", f->id().c_str(), d->total_dupacks(), d->max_num_dupacks());
-		printf("%s lasted %.2f seconds\n", f->id().c_str(), d->duration() / 1000000.0);
+		printf("%s has sent %lu unique bytes\n", id, it->unique_bytes);
+		if (level == TRACK_RANGES)
+			printf("%s has %u (%u) retransmissions\n", id, it->retrans, it->max_retrans);
+		else
+			printf("%s has %u retransmissions\n", id, it->retrans);
+		if (level != TRACK_COUNTERS && it->rtt != UINT64_MAX)
+			printf("%s has RTT %.2f ms\n", id, it->rtt / 1000.0);
+		if (it->rtt_samples.count() > 0)
+		{
+			printf("%s has %u RTT samples, min/avg/max/stddev %.2f/%.2f/%.2f/%.2f ms\n", id, it->rtt_samples.count(),
+					it->rtt_samples.min() / 1000.0, it->rtt_samples.mean() / 1000.0,
+					it->rtt_samples.max() / 1000.0, it->rtt_samples.stddev() / 1000.0);
+		}
+		if (level == TRACK_RANGES)
+			printf("%s has %u (%u) dupacks\n", id, it->dupacks, it->max_dupacks);
+		else
+			printf("%s has %u dupacks\n", id, it->dupacks);
+		printf("%s has %u fast (%lu bytes), %u timeout (%lu bytes) and %u spurious (%lu bytes) retransmission episodes\n", id,
+				it->episodes[episode::FAST], it->episode_bytes[episode::FAST],
+				it->episodes[episode::TIMEOUT], it->episode_bytes[episode::TIMEOUT],
+				it->episodes[episode::SPURIOUS], it->episode_bytes[episode::SPURIOUS]);
+		printf("%s lasted %.2f seconds\n", id, it->duration / 1000000.0);
 
 		printf("\n");
 	}
 
+	if (socket_path != NULL)
+	{
+		// Keep answering queries about the final state until interrupted
+		fflush(stdout);
+		pthread_join(stop_thread, NULL);
+		stop_query_server(stop.server);
+	}
+
 	return 0;
 }
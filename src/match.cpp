@@ -1,5 +1,6 @@
 #include "flow.h"
 #include "range.h"
+#include "rollup.h"
 #include <map>
 #include <vector>
 #include <algorithm>
@@ -11,6 +12,9 @@
 #define sequential(x, y)   ((int32_t) ((x) - (y)) < 0)
 #define i_sequential(x, y) ((int32_t) ((y) - (x)) >= 0)
 
+/* Number of duplicate ACKs that trigger a fast retransmit */
+#define DUPACK_THRESHOLD 3
+
 
 /* 
  * Helper function to handle sequence number wrapping 
@@ -59,6 +63,7 @@ static inline uint64_t relative(uint32_t seqno, uint32_t first, uint32_t last, u
  */
 inline void flowdata::find_and_split_ranges(range_list& list, const range& key, bool include_new_ranges)
 {
+	range_map& ranges = range_store();
 	range_map::iterator curr, next, last, lo, hi, ins;
 
 	lo = ranges.lower_bound(key);
@@ -78,7 +83,7 @@ inline void flowdata::find_and_split_ranges(range_list& list, const range& key,
 		ins = ranges.insert(lo, range_map::value_type(range(key.seqno_lo, lo->first.seqno_lo), lo->second));
 
 		if (include_new_ranges)
-			list.push_back(&ins->second);
+			list.push_back(ins);
 	}
 
 	// Check if we have new trailing data
@@ -87,7 +92,7 @@ inline void flowdata::find_and_split_ranges(range_list& list, const range& key,
 		last = ranges.insert(hi, range_map::value_type(range(hi->first.seqno_hi, key.seqno_hi), hi->second));
 
 		if (include_new_ranges)
-			list.push_back(&last->second);
+			list.push_back(last);
 	}
 
 	// Find partial matches and split existing ranges
@@ -143,7 +148,7 @@ inline void flowdata::find_and_split_ranges(range_list& list, const range& key,
 			assert(false);
 		}
 
-		list.push_back(&ins->second);
+		list.push_back(ins);
 	}
 
 	return;
@@ -151,20 +156,148 @@ inline void flowdata::find_and_split_ranges(range_list& list, const range& key,
 
 
 
+/*
+ * Helper method to merge adjacent ranges, which keeps the range map of a long
+ * flow from growing with every segment. Two ranges are merged when they have
+ * the same history, which splitting leaves behind once both parts have seen
+ * the same transmissions and ACKs, or when both are below the cumulative ACK
+ * and were acknowledged once for each of the same number of transmissions.
+ * Only the updated ranges in the list and their neighbours are checked, as
+ * only they can have changed.
+ *
+ * Ranges with retransmissions or duplicate ACKs are only merged with the
+ * same history, so their counts don't change. Merging acknowledged ranges
+ * keeps the timestamps of the part with the lower RTT sample: rtt() still
+ * finds the minimum, but the other RTT samples and the send and ACK times
+ * of the dropped part are lost.
+ */
+inline void flowdata::coalesce_ranges(const range_list& list)
+{
+	range_map& ranges = range_store();
+	range_map::iterator curr, next, last;
+
+	// The updated ranges are adjacent, but not listed in order
+	curr = last = list.front();
+	for (range_list::const_iterator it = list.begin(); it != list.end(); ++it)
+	{
+		if ((*it)->first.seqno_lo < curr->first.seqno_lo)
+			curr = *it;
+		if ((*it)->first.seqno_lo > last->first.seqno_lo)
+			last = *it;
+	}
+
+	if (curr != ranges.begin())
+		--curr;
+	if (++last != ranges.end())
+		++last;
+
+	next = curr;
+	while (curr != last && ++next != last)
+	{
+		bool acked = curr_ack != UINT64_MAX && next->first.seqno_hi <= curr_ack
+			&& curr->second.settled() && curr->second.same_counts(next->second);
+
+		if (curr->first.seqno_hi == next->first.seqno_lo && (acked || curr->second.same_history(next->second)))
+		{
+			const rangedata& kept = next->second.rtt_sample() < curr->second.rtt_sample() ? next->second : curr->second;
+
+			// The merged range is ordered right where the two ranges were
+			range merged(curr->first.seqno_lo, next->first.seqno_hi);
+			range_map::iterator ins = ranges.insert(curr, range_map::value_type(merged, kept));
+			ranges.erase(curr);
+			ranges.erase(next);
+			curr = next = ins;
+		}
+		else
+		{
+			curr = next;
+		}
+	}
+}
+
+
+
+/*
+ * Classify a retransmitted byte range and add it to the retransmission episodes.
+ */
+inline void flowdata::register_retrans(uint64_t rel_start, uint64_t rel_end, const timeval& ts)
+{
+	episode::kind type;
+	uint64_t now = USECS(ts);
+
+	if (curr_ack != UINT64_MAX && rel_end <= curr_ack)
+	{
+		// All of the data has already been acknowledged
+		type = episode::SPURIOUS;
+	}
+	else if (dupacks >= DUPACK_THRESHOLD)
+	{
+		// The receiver signalled loss with duplicate ACKs
+		type = episode::FAST;
+	}
+	else
+	{
+		// No signal from the receiver, the sender must have timed out
+		type = episode::TIMEOUT;
+	}
+
+	if (!in_episode || retrans.back().type != type)
+	{
+		if (retrans.size() == EPISODE_HISTORY)
+		{
+			// Fold the oldest episode, which has ended, into the counters
+			++folded_episodes[retrans.front().type];
+			folded_bytes[retrans.front().type] += retrans.front().bytes;
+			retrans.erase(retrans.begin());
+		}
+
+		retrans.push_back(episode(type, now));
+		in_episode = true;
+		recover = rel_end;
+	}
+
+	episode& curr = retrans.back();
+	curr.duration = now - curr.start;
+	curr.bytes += rel_end - rel_start;
+	++retrans_segments;
+
+	if (rel_end > recover)
+	{
+		recover = rel_end;
+	}
+}
+
+
+
 /*
  * Increase sent count on a byte range.
  */
+template <class policy>
 void flowdata::register_sent(uint32_t start, uint32_t end, const timeval& ts)
 {
+	// Sequence numbers are relative to the start of the first segment, so
+	// that its data counts when the flow was picked up without its SYN
 	if (rel_seqno_max == UINT64_MAX)
 	{
-		abs_seqno_min = abs_seqno_max = end;
+		abs_seqno_min = abs_seqno_max = start;
 		rel_seqno_max = 0;
 
 		ts_first = ts;
 		ts_last = ts;
 	}
 
+	// Skip data from before the first segment we saw, which happens when
+	// analysis starts in the middle of a connection (only detectable until
+	// the sequence numbers have advanced half the sequence space)
+	if (rel_seqno_max < INT32_MAX && sequential(start, abs_seqno_min))
+	{
+		if (!sequential(abs_seqno_min, end))
+		{
+			return;
+		}
+		start = abs_seqno_min;
+	}
+
 	if (USECS(ts) > USECS(ts_last))
 	{
 		ts_last = ts;
@@ -175,6 +308,12 @@ void flowdata::register_sent(uint32_t start, uint32_t end, const timeval& ts)
 	rel_start = relative(start, abs_seqno_min, abs_seqno_max, rel_seqno_max);
 	rel_end = relative(end, abs_seqno_min, abs_seqno_max, rel_seqno_max);
 
+	// Data below the highest sequence number has been sent before
+	if (rel_start < rel_seqno_max && rel_start < rel_end)
+	{
+		register_retrans(rel_start, rel_end < rel_seqno_max ? rel_end : rel_seqno_max, ts);
+	}
+
 	if (rel_end > rel_seqno_max)
 	{
 		rel_seqno_max = rel_end;
@@ -182,7 +321,7 @@ void flowdata::register_sent(uint32_t start, uint32_t end, const timeval& ts)
 	}
 
 	// Check if there actually is any data to update
-	if ((end - start) == 0)
+	if (!policy::ranges || (end - start) == 0)
 	{
 		return;
 	}
@@ -196,16 +335,18 @@ void flowdata::register_sent(uint32_t start, uint32_t end, const timeval& ts)
 	if (list.empty())
 	{
 		// We have a completely new range
-		ranges.insert(std::pair<range,rangedata>(key, ts));
+		list.push_back(range_store().insert(std::pair<range,rangedata>(key, ts)));
 	}
 	else
 	{
 		// Update existing ranges' transmission count
 		for (range_list::iterator it = list.begin(); it != list.end(); ++it)
 		{
-			(*it)->sent.push_back(ts);
+			(*it)->second.sent.push_back(ts);
 		}
 	}
+
+	coalesce_ranges(list);
 }
 
 
@@ -213,17 +354,30 @@ void flowdata::register_sent(uint32_t start, uint32_t end, const timeval& ts)
 /*
  * Mark a byte range as acknowledged.
  */
-void flowdata::register_ack(uint32_t ackno, const timeval& ts)
+template <class policy>
+void flowdata::register_ack(uint32_t ackno, uint32_t data_len, const timeval& ts)
 {
+	if (rel_seqno_max == UINT64_MAX)
+	{
+		// Nothing has been sent yet, so there is nothing to acknowledge
+		return;
+	}
+
 	if (curr_ack == UINT64_MAX)
 	{
-		abs_ackno_min = abs_ackno_max = ackno;
 		curr_ack = prev_ack = 0;
 	}
 
-	uint64_t rel_ackno = relative(ackno, abs_ackno_min, abs_ackno_max, curr_ack);
+	// Skip acknowledgements of data from before the first segment we saw
+	if (rel_seqno_max < INT32_MAX && sequential(ackno, abs_seqno_min))
+	{
+		return;
+	}
+
+	// Acknowledgement numbers are relative to the sent sequence numbers
+	uint64_t rel_ackno = relative(ackno, abs_seqno_min, abs_seqno_max, rel_seqno_max);
 
-	if (rel_ackno == 0 || (ackno - abs_seqno_min) == 1)
+	if (rel_ackno == 0)
 	{
 		return;
 	}
@@ -237,36 +391,132 @@ void flowdata::register_ack(uint32_t ackno, const timeval& ts)
 	}
 	else if (rel_ackno <= curr_ack)
 	{
+		// Only pure ACKs are duplicate ACKs (RFC 5681), a data segment
+		// carries the same ACK without acknowledging anything new
+		if (data_len > 0)
+		{
+			return;
+		}
+
 		// We got a duplicate ACK
-		range key(prev_ack, rel_ackno);
-		find_and_split_ranges(list, key, true);
+		if (policy::ranges)
+		{
+			range key(prev_ack, rel_ackno);
+			find_and_split_ranges(list, key, true);
+		}
+
+		if (rel_ackno == curr_ack && curr_ack < rel_seqno_max)
+		{
+			++dupacks;
+			++dupacks_total;
+		}
 	}
 	else if (rel_ackno > curr_ack)
 	{
 		// We got a new ACK
-		range key(curr_ack, rel_ackno);
-		find_and_split_ranges(list, key, true);
+		if (policy::ranges)
+		{
+			range key(curr_ack, rel_ackno);
+			find_and_split_ranges(list, key, true);
+		}
 
-		abs_ackno_max = ackno;
 		prev_ack = curr_ack;
 		curr_ack = rel_ackno;
+		dupacks = 0;
+
+		// End the ongoing retransmission episode once everything is acknowledged
+		if (in_episode && rel_ackno >= recover)
+		{
+			retrans.back().duration = USECS(ts) - retrans.back().start;
+			in_episode = false;
+		}
 	}
 
 	// Update acknowledgement times for all the matching ranges
 	for (range_list::iterator it = list.begin(); it != list.end(); ++it)
 	{
-		(*it)->ackd.push_back(ts);
+		(*it)->second.ackd.push_back(ts);
+	}
+
+	if (!list.empty())
+	{
+		coalesce_ranges(list);
+	}
+}
+
+
+
+/*
+ * Instantiate the ingestion path of every tracking level
+ */
+template void flowdata::register_sent<track_counters>(uint32_t, uint32_t, const timeval&);
+template void flowdata::register_sent<track_rtt>(uint32_t, uint32_t, const timeval&);
+template void flowdata::register_sent<track_ranges>(uint32_t, uint32_t, const timeval&);
+template void flowdata::register_ack<track_counters>(uint32_t, uint32_t, const timeval&);
+template void flowdata::register_ack<track_rtt>(uint32_t, uint32_t, const timeval&);
+template void flowdata::register_ack<track_ranges>(uint32_t, uint32_t, const timeval&);
+
+
+
+/*
+ * Remember when a TSval was sent, so that its echo gives an RTT sample.
+ */
+void flowdata::register_tsval(uint32_t tsval, const timeval& ts)
+{
+	if (rtt_data == NULL)
+	{
+		rtt_data = new rtt_state;
+	}
+
+	rtt_data->tsvals.sent(tsval, USECS(ts));
+}
+
+
+
+/*
+ * Match an echoed TSval with the time it was sent.
+ */
+bool flowdata::register_tsecr(uint32_t tsecr, const timeval& ts, uint64_t& rtt)
+{
+	uint64_t sent;
+	uint64_t now = USECS(ts);
+
+	if (rtt_data != NULL && rtt_data->tsvals.echoed(tsecr, sent) && now >= sent)
+	{
+		rtt = now - sent;
+		rtt_data->samples.sample(rtt);
+		return true;
 	}
+
+	return false;
 }
 
 
 
 flowdata::flowdata()
 	: abs_seqno_min(0), abs_seqno_max(0), rel_seqno_max(UINT64_MAX)
-	, abs_ackno_min(0), abs_ackno_max(0), curr_ack(UINT64_MAX), prev_ack(UINT64_MAX)
+	, curr_ack(UINT64_MAX), prev_ack(UINT64_MAX), dupacks(0)
+	, dupacks_total(0), retrans_segments(0), rtt_data(NULL), rollup_data(NULL)
+	, range_data(NULL), spill_off(0), spill_cap(0), spill_len(0), footprint(0), slot(UINT32_MAX)
+	, in_episode(false), recover(0)
 {
 	ts_first.tv_sec = ts_first.tv_usec = 0;
 	ts_last.tv_sec = ts_last.tv_usec = 0;
+
+	for (unsigned type = episode::FAST; type <= episode::SPURIOUS; ++type)
+	{
+		folded_episodes[type] = 0;
+		folded_bytes[type] = 0;
+	}
+}
+
+
+
+flowdata::~flowdata()
+{
+	delete rtt_data;
+	delete rollup_data;
+	delete range_data;
 }
 
 
@@ -279,13 +529,51 @@ flowdata& flowdata::operator=(const flowdata& rhs)
 	abs_seqno_max = rhs.abs_seqno_max;
 	rel_seqno_max = rhs.rel_seqno_max;
 
-	abs_ackno_min = rhs.abs_ackno_min;
-	abs_ackno_max = rhs.abs_ackno_max;
 	curr_ack = rhs.curr_ack;
 	prev_ack = rhs.prev_ack;
+	dupacks = rhs.dupacks;
+	dupacks_total = rhs.dupacks_total;
+	retrans_segments = rhs.retrans_segments;
+
+	retrans = rhs.retrans;
+	for (unsigned type = episode::FAST; type <= episode::SPURIOUS; ++type)
+	{
+		folded_episodes[type] = rhs.folded_episodes[type];
+		folded_bytes[type] = rhs.folded_bytes[type];
+	}
+	in_episode = rhs.in_episode;
+	recover = rhs.recover;
 
 	ts_first = rhs.ts_first;
 	ts_last = rhs.ts_last;
 
+	if (rhs.rtt_data != NULL)
+	{
+		if (rtt_data == NULL)
+			rtt_data = new rtt_state;
+		*rtt_data = *rhs.rtt_data;
+	}
+	else
+	{
+		delete rtt_data;
+		rtt_data = NULL;
+	}
+
+	if (rhs.rollup_data != NULL)
+	{
+		if (rollup_data == NULL)
+			rollup_data = new rollup_state;
+		*rollup_data = *rhs.rollup_data;
+	}
+	else
+	{
+		delete rollup_data;
+		rollup_data = NULL;
+	}
+
+	// The spill store slot stays with the original, copies may only read it
+	spill_off = rhs.spill_off;
+	spill_len = rhs.spill_len;
+
 	return *this;
 }
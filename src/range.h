@@ -87,9 +87,53 @@ class rangedata
 			return *this;
 		};
 
+		/* Are the ranges sent and acknowledged at the same times */
+		inline bool same_history(const rangedata& other) const
+		{
+			return same_times(sent, other.sent) && same_times(ackd, other.ackd);
+		};
+
+		/* Have the ranges been sent and acknowledged the same number of times */
+		inline bool same_counts(const rangedata& other) const
+		{
+			return sent.size() == other.sent.size() && ackd.size() == other.ackd.size();
+		};
+
+		/* Has the range been acknowledged once for every transmission */
+		inline bool settled() const
+		{
+			return !sent.empty() && sent.size() == ackd.size();
+		};
+
+		/*
+		 * Time from sending the range until it was acknowledged (usecs), or
+		 * UINT64_MAX if it was retransmitted or not acknowledged, as the
+		 * transmission that was acknowledged can't be told
+		 */
+		inline uint64_t rtt_sample() const
+		{
+			if (ackd.empty() || sent.size() != 1)
+				return UINT64_MAX;
+			return ((uint64_t) ackd.front().tv_sec * 1000000 + ackd.front().tv_usec)
+				- ((uint64_t) sent.front().tv_sec * 1000000 + sent.front().tv_usec);
+		};
+
 	private: 
 		std::vector<timeval> sent;	// the timestamps this range was registered as sent
 		std::vector<timeval> ackd;	// the timestamps this range was acknowledged
+
+		static inline bool same_times(const std::vector<timeval>& lhs, const std::vector<timeval>& rhs)
+		{
+			if (lhs.size() != rhs.size())
+				return false;
+
+			for (std::vector<timeval>::size_type i = 0; i < lhs.size(); ++i)
+			{
+				if (lhs[i].tv_sec != rhs[i].tv_sec || lhs[i].tv_usec != rhs[i].tv_usec)
+					return false;
+			}
+			return true;
+		};
 };
 
 #endif
@@ -0,0 +1,189 @@
+#include "registry.h"
+#include "flow.h"
+#include <stdexcept>
+#include <tr1/cstdint>
+#include <cstdlib>
+
+
+/*
+ * Number of 64-bit words in a summary
+ */
+#define SUMMARY_WORDS (sizeof(flow_summary) / sizeof(uint64_t))
+
+/*
+ * Multiplier of the index hash (the 64-bit golden ratio)
+ */
+#define INDEX_MULTIPLIER ((((uint64_t) 0x9e3779b9) << 32) | 0x7f4a7c15)
+
+
+
+/*
+ * Index chain of a flow, from its identifiers as stored in a summary
+ */
+static inline uint32_t index_chain(uint64_t src_addr, uint64_t src_port, uint64_t dst_addr, uint64_t dst_port)
+{
+	uint64_t key = ((src_addr << 32) | dst_addr) ^ (((src_port << 16) | dst_port) * INDEX_MULTIPLIER);
+	return (key * INDEX_MULTIPLIER) >> (64 - REGISTRY_INDEX_BITS);
+}
+
+
+
+registry::registry()
+	: chunks(new slot* volatile[REGISTRY_MAX_CHUNKS]), published(0)
+{
+	// Untouched chains of a calloc'ed index take no memory
+	index = (volatile uint32_t*) calloc(1 << REGISTRY_INDEX_BITS, sizeof(uint32_t));
+	if (index == NULL)
+	{
+		delete[] chunks;
+		throw std::runtime_error("Unable to allocate registry index");
+	}
+}
+
+
+
+registry::~registry()
+{
+	for (uint32_t i = 0; i < published; i += REGISTRY_CHUNK_SIZE)
+	{
+		delete[] chunks[i / REGISTRY_CHUNK_SIZE];
+	}
+
+	delete[] chunks;
+	free((void*) index);
+}
+
+
+
+void registry::publish(const flow& conn, flowdata& data)
+{
+	// The opposite flow of a connection seen in one direction stays unlisted
+	if (!data.seen())
+	{
+		return;
+	}
+
+	// Fill in the summary outside of the slot, so the critical section is short
+	flow_summary summary;
+	const rttstats& samples = data.rtt_samples();
+
+	summary.src_addr = conn.src_addr();
+	summary.dst_addr = conn.dst_addr();
+	summary.src_port = conn.src_port();
+	summary.dst_port = conn.dst_port();
+	summary.bytes = data.highest_seqno();
+	summary.retrans = data.retrans_count();
+	summary.dupacks = data.dupack_count();
+	summary.rtt_count = samples.count();
+	summary.rtt_min = samples.count() > 0 ? samples.min() : 0;
+	summary.rtt_mean = (uint64_t) samples.mean();
+	summary.first = USECS(data.ts_first);
+	summary.last = USECS(data.ts_last);
+
+	bool added = false;
+	if (data.slot == UINT32_MAX)
+	{
+		// First time this flow is published, append a slot
+		uint32_t idx = published;
+		if (idx / REGISTRY_CHUNK_SIZE >= REGISTRY_MAX_CHUNKS)
+		{
+			throw std::runtime_error("Too many flows to publish");
+		}
+
+		if (idx % REGISTRY_CHUNK_SIZE == 0)
+		{
+			slot* chunk = new slot[REGISTRY_CHUNK_SIZE];
+			for (unsigned i = 0; i < REGISTRY_CHUNK_SIZE; ++i)
+			{
+				chunk[i].seq = 0;
+			}
+			__atomic_store_n(&chunks[idx / REGISTRY_CHUNK_SIZE], chunk, __ATOMIC_RELEASE);
+		}
+
+		data.slot = idx;
+		added = true;
+	}
+
+	slot& s = chunks[data.slot / REGISTRY_CHUNK_SIZE][data.slot % REGISTRY_CHUNK_SIZE];
+	const uint64_t* src = (const uint64_t*) &summary;
+	uint64_t* dst = (uint64_t*) &s.summary;
+	uint64_t seq = s.seq;
+
+	// Mark the slot as being written, and keep the words from being written before the mark
+	__atomic_store_n(&s.seq, seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	for (unsigned i = 0; i < SUMMARY_WORDS; ++i)
+	{
+		__atomic_store_n(&dst[i], src[i], __ATOMIC_RELAXED);
+	}
+
+	__atomic_store_n(&s.seq, seq + 2, __ATOMIC_RELEASE);
+
+	if (added)
+	{
+		// Link the slot into its index chain once the summary is written
+		uint32_t chain = index_chain(summary.src_addr, summary.src_port, summary.dst_addr, summary.dst_port);
+		s.next = index[chain];
+		__atomic_store_n(&index[chain], data.slot + 1, __ATOMIC_RELEASE);
+
+		__atomic_store_n(&published, data.slot + 1, __ATOMIC_RELEASE);
+	}
+}
+
+
+
+uint32_t registry::count() const
+{
+	return __atomic_load_n(&published, __ATOMIC_ACQUIRE);
+}
+
+
+
+void registry::read(uint32_t idx, flow_summary& summary) const
+{
+	slot* chunk = __atomic_load_n(&chunks[idx / REGISTRY_CHUNK_SIZE], __ATOMIC_ACQUIRE);
+	slot& s = chunk[idx % REGISTRY_CHUNK_SIZE];
+	const uint64_t* src = (const uint64_t*) &s.summary;
+	uint64_t* dst = (uint64_t*) &summary;
+	uint64_t before, after;
+
+	// Retry until the writer did not touch the slot while it was copied
+	do
+	{
+		before = __atomic_load_n(&s.seq, __ATOMIC_ACQUIRE);
+
+		for (unsigned i = 0; i < SUMMARY_WORDS; ++i)
+		{
+			dst[i] = __atomic_load_n(&src[i], __ATOMIC_RELAXED);
+		}
+
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		after = __atomic_load_n(&s.seq, __ATOMIC_RELAXED);
+	}
+	while ((before & 1) || before != after);
+}
+
+
+
+bool registry::find(const flow& conn, flow_summary& summary) const
+{
+	uint32_t chain = index_chain(conn.src_addr(), conn.src_port(), conn.dst_addr(), conn.dst_port());
+
+	// Chains are only prepended to, and the links of a slot never change
+	for (uint32_t next = __atomic_load_n(&index[chain], __ATOMIC_ACQUIRE); next != 0; )
+	{
+		uint32_t idx = next - 1;
+		read(idx, summary);
+
+		if (summary.src_addr == conn.src_addr() && summary.src_port == conn.src_port()
+				&& summary.dst_addr == conn.dst_addr() && summary.dst_port == conn.dst_port())
+		{
+			return true;
+		}
+
+		next = chunks[idx / REGISTRY_CHUNK_SIZE][idx % REGISTRY_CHUNK_SIZE].next;
+	}
+
+	return false;
+}
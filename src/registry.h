@@ -0,0 +1,96 @@
+#ifndef __REGISTRY_H__
+#define __REGISTRY_H__
+
+#include <tr1/cstdint>
+#include "flow.h"
+
+
+/*
+ * Number of summaries per chunk, and maximum number of chunks
+ */
+#define REGISTRY_CHUNK_SIZE 4096
+#define REGISTRY_MAX_CHUNKS 16384
+
+/*
+ * Number of bits of the hash index over the published flows (the index has
+ * 2^bits chains)
+ */
+#define REGISTRY_INDEX_BITS 20
+
+
+
+/*
+ * A snapshot of the statistics of a flow.
+ * Every field is a 64-bit word, so it can be copied word by word with
+ * atomic loads and stores.
+ */
+struct flow_summary
+{
+	uint64_t src_addr;		// source IP address
+	uint64_t dst_addr;		// destination IP address
+	uint64_t src_port;		// source port
+	uint64_t dst_port;		// destination port
+	uint64_t bytes;			// highest sequence number sent
+	uint64_t retrans;		// retransmitted segments
+	uint64_t dupacks;		// duplicate ACKs
+	uint64_t rtt_count;		// number of RTT samples
+	uint64_t rtt_min;		// smallest RTT sample (usecs)
+	uint64_t rtt_mean;		// mean RTT (usecs)
+	uint64_t first;			// first registered segment (usecs)
+	uint64_t last;			// last registered segment (usecs)
+};
+
+
+
+/*
+ * A registry of flow summaries, published by the ingestion thread of a flow
+ * table and read concurrently by query threads.
+ *
+ * The registry is append-only and never moves a summary, so readers can walk
+ * it without touching the connection map. Each summary is guarded by a
+ * sequence lock: the single writer never waits, and readers retry until they
+ * get a consistent copy. A hash index, whose chains are only ever prepended
+ * to, finds the summary of a flow without a walk.
+ */
+class registry
+{
+	public:
+		registry();
+		~registry();
+
+		/*
+		 * Publish the current statistics of a flow (ingestion thread only),
+		 * unless it has not sent anything yet
+		 */
+		void publish(const flow& conn, flowdata& data);
+
+		/* Number of published flows */
+		uint32_t count() const;
+
+		/* Read a consistent copy of a published summary */
+		void read(uint32_t idx, flow_summary& summary) const;
+
+		/*
+		 * Read a consistent copy of the summary of a flow.
+		 * Returns false if the flow was never published.
+		 */
+		bool find(const flow& conn, flow_summary& summary) const;
+
+	private:
+		struct slot
+		{
+			volatile uint64_t seq;	// odd while the summary is being written
+			uint32_t next;			// next slot in the index chain, plus one (0 ends the chain)
+			flow_summary summary;
+		};
+
+		slot* volatile* chunks;		// REGISTRY_MAX_CHUNKS chunks, allocated when first used
+		volatile uint32_t published;
+		volatile uint32_t* index;	// first slot of each index chain, plus one (0 for an empty chain)
+
+		/* Registries are not copyable */
+		registry(const registry& other);
+		registry& operator=(const registry& other);
+};
+
+#endif
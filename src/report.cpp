@@ -0,0 +1,179 @@
+#include "report.h"
+#include "flow.h"
+#include <vector>
+#include <tr1/cstdint>
+#include <pthread.h>
+#include <stdexcept>
+#include <string>
+
+using std::vector;
+
+
+/*
+ * Number of partitions per thread, more partitions than threads evens out
+ * flows of varying cost
+ */
+#define PARTITIONS_PER_THREAD 8
+
+
+
+void flowstats::compute(const flow_table& flows, const flow& conn, const flowdata& flow_data, tracking level)
+{
+	flowdata copy;
+	const flowdata* ptr = &flow_data;
+
+	if (flow_data.spilled())
+	{
+		// Merge spilled range data back into a private copy of the flow
+		copy = flow_data;
+		flows.reload(copy);
+		ptr = &copy;
+	}
+
+	const flowdata& data = *ptr;
+
+	id = conn.id();
+	rtt = data.rtt();
+	rtt_samples = data.rtt_samples();
+	duration = data.duration();
+
+	if (level == TRACK_RANGES)
+	{
+		unique_bytes = data.unique_bytes_sent();
+		retrans = data.total_retrans();
+		max_retrans = data.max_num_retrans();
+		dupacks = data.total_dupacks();
+		max_dupacks = data.max_num_dupacks();
+	}
+	else
+	{
+		unique_bytes = data.highest_seqno();
+		retrans = data.retrans_count();
+		max_retrans = 0;
+		dupacks = data.dupack_count();
+		max_dupacks = 0;
+	}
+
+	for (unsigned type = episode::FAST; type <= episode::SPURIOUS; ++type)
+	{
+		episodes[type] = data.num_episodes((episode::kind) type);
+		episode_bytes[type] = data.episode_bytes((episode::kind) type);
+	}
+}
+
+
+
+/*
+ * Work shared by the threads of the pool
+ */
+struct workload
+{
+	const flow_table* flows;
+	vector<flow_table::iterator> bounds;	// partition i is [bounds[i], bounds[i+1])
+	vector<uint32_t> offsets;		// index of the first result of each partition
+	vector<flowstats>* results;
+	tracking level;
+	volatile uint32_t next;			// next partition to be processed
+	volatile uint32_t failed;		// set by the first thread to fail
+	std::string error;				// error message of the failed thread
+};
+
+
+
+static void* worker(void* arg)
+{
+	workload* work = (workload*) arg;
+	uint32_t part;
+
+	try
+	{
+		while ((part = __sync_fetch_and_add(&work->next, 1)) < work->bounds.size() - 1)
+		{
+			uint32_t idx = work->offsets[part];
+
+			for (flow_table::iterator it = work->bounds[part]; it != work->bounds[part + 1]; ++it, ++idx)
+			{
+				(*work->results)[idx].compute(*work->flows, it.conn(), it.data(), work->level);
+			}
+		}
+	}
+	catch (const std::runtime_error& e)
+	{
+		if (__sync_bool_compare_and_swap(&work->failed, 0, 1))
+		{
+			work->error = e.what();
+		}
+	}
+
+	return NULL;
+}
+
+
+
+void finalize_stats(const flow_table& flows, vector<flowstats>& results, tracking level, unsigned num_threads)
+{
+	uint32_t count = flows.count();
+	uint32_t parts = num_threads * PARTITIONS_PER_THREAD;
+	workload work;
+
+	if (num_threads == 0)
+	{
+		num_threads = 1;
+		parts = PARTITIONS_PER_THREAD;
+	}
+
+	if (parts > count)
+	{
+		parts = count > 0 ? count : 1;
+	}
+
+	results.resize(count);
+	work.flows = &flows;
+	work.results = &results;
+	work.level = level;
+	work.next = 0;
+	work.failed = 0;
+
+	// Split the connections into contiguous partitions, so that results end
+	// up in connection order no matter which thread computes them
+	uint32_t idx = 0, part = 0;
+	for (flow_table::iterator it = flows.begin(); it != flows.end() && part < parts; ++it, ++idx)
+	{
+		if (idx == (uint64_t) part * count / parts)
+		{
+			work.bounds.push_back(it);
+			work.offsets.push_back(idx);
+			++part;
+		}
+	}
+	work.bounds.push_back(flows.end());
+
+	if (work.bounds.size() == 1)
+	{
+		return;
+	}
+
+	// Start the pool, the calling thread is part of it
+	vector<pthread_t> threads;
+	for (unsigned i = 1; i < num_threads && i < parts; ++i)
+	{
+		pthread_t thread;
+		if (pthread_create(&thread, NULL, worker, &work) != 0)
+		{
+			break;
+		}
+		threads.push_back(thread);
+	}
+
+	worker(&work);
+
+	for (unsigned i = 0; i < threads.size(); ++i)
+	{
+		pthread_join(threads[i], NULL);
+	}
+
+	if (work.failed)
+	{
+		throw std::runtime_error(work.error);
+	}
+}
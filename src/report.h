@@ -0,0 +1,41 @@
+#ifndef __REPORT_H__
+#define __REPORT_H__
+
+#include <tr1/cstdint>
+#include <string>
+#include <vector>
+#include "flow.h"
+
+
+
+/*
+ * Final statistics of a flow, computed once ingestion is done.
+ */
+struct flowstats
+{
+	std::string id;				// human readable flow identifier
+	uint64_t unique_bytes;		// number of unique bytes sent
+	uint32_t retrans;			// total number of retransmissions
+	uint32_t max_retrans;		// highest number of retransmissions of a range (ranges only)
+	uint64_t rtt;				// round-trip time (usecs)
+	rttstats rtt_samples;		// RTT samples from TCP timestamps
+	uint32_t dupacks;			// total number of duplicate ACKs
+	uint32_t max_dupacks;		// highest number of duplicate ACKs of a range (ranges only)
+	uint32_t episodes[3];		// retransmission episodes per episode::kind
+	uint64_t episode_bytes[3];	// bytes retransmitted per episode::kind
+	uint64_t duration;			// flow duration (usecs)
+
+	void compute(const flow_table& flows, const flow& conn, const flowdata& data, tracking level);
+};
+
+
+
+/*
+ * Compute the statistics of all connections using a pool of threads.
+ * Statistics that need range history are only computed at TRACK_RANGES.
+ * The results are in the same order as the connections.
+ * Throws std::runtime_error if spilled flows can't be reloaded.
+ */
+void finalize_stats(const flow_table& flows, std::vector<flowstats>& results, tracking level, unsigned num_threads);
+
+#endif
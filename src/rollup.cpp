@@ -0,0 +1,181 @@
+#include "rollup.h"
+#include "flow.h"
+#include <string>
+#include <sstream>
+#include <cstring>
+#include <tr1/cstdint>
+#include <arpa/inet.h>
+
+using std::string;
+
+
+
+aggregate::aggregate()
+	: connections(0), bytes(0), retrans(0), dupacks(0)
+{
+	memset(rtt, 0, sizeof(rtt));
+}
+
+
+
+rollup_table::rollup_table()
+	: prefix(24), netmask(htonl(0xffffff00))
+{
+	for (unsigned key = 0; key < ROLLUP_KEYS; ++key)
+	{
+		active[key] = false;
+	}
+}
+
+
+
+void rollup_table::enable(rollup_key key, unsigned prefix_len)
+{
+	active[key] = true;
+
+	if (key == ROLLUP_SUBNET)
+	{
+		prefix = prefix_len;
+		netmask = prefix_len > 0 ? htonl(0xffffffff << (32 - prefix_len)) : 0;
+	}
+}
+
+
+
+flowdata::rollup_state& rollup_table::attach(const flow& conn, flowdata& data)
+{
+	if (data.rollup_data != NULL)
+	{
+		return *data.rollup_data;
+	}
+
+	flowdata::rollup_state* state = new flowdata::rollup_state;
+	memset(state, 0, sizeof(*state));
+	data.rollup_data = state;
+
+	// The server is the endpoint with the lower port
+	bool from_server = ntohs(conn.src_port()) < ntohs(conn.dst_port())
+		|| (conn.src_port() == conn.dst_port() && ntohl(conn.src_addr()) < ntohl(conn.dst_addr()));
+
+	uint32_t client = from_server ? conn.dst_addr() : conn.src_addr();
+	uint32_t server = from_server ? conn.src_addr() : conn.dst_addr();
+	uint16_t port = from_server ? conn.src_port() : conn.dst_port();
+
+	uint64_t values[ROLLUP_KEYS];
+	values[ROLLUP_SUBNET] = ntohl(client & netmask);
+	values[ROLLUP_PORT] = ntohs(port);
+	values[ROLLUP_PAIR] = (((uint64_t) ntohl(client)) << 32) | ntohl(server);
+
+	for (unsigned key = 0; key < ROLLUP_KEYS; ++key)
+	{
+		if (active[key])
+		{
+			state->entries[key] = &maps[key][values[key]];
+
+			// Both directions of a connection are attached, count it once
+			if (!from_server)
+				++state->entries[key]->connections;
+		}
+	}
+
+	return *state;
+}
+
+
+
+void rollup_table::update(const flow& conn, flowdata& data)
+{
+	flowdata::rollup_state& state = attach(conn, data);
+
+	uint64_t bytes = data.highest_seqno();
+	uint32_t retrans = data.retrans_count();
+	uint32_t dupacks = data.dupack_count();
+
+	if (bytes == state.bytes && retrans == state.retrans && dupacks == state.dupacks)
+	{
+		return;
+	}
+
+	for (unsigned key = 0; key < ROLLUP_KEYS; ++key)
+	{
+		aggregate* entry = state.entries[key];
+		if (entry != NULL)
+		{
+			entry->bytes += bytes - state.bytes;
+			entry->retrans += retrans - state.retrans;
+			entry->dupacks += dupacks - state.dupacks;
+		}
+	}
+
+	state.bytes = bytes;
+	state.retrans = retrans;
+	state.dupacks = dupacks;
+}
+
+
+
+void rollup_table::sample(const flow& conn, flowdata& data, uint64_t rtt)
+{
+	flowdata::rollup_state& state = attach(conn, data);
+
+	unsigned bucket = 0;
+	while (bucket < RTT_BUCKETS - 1 && rtt >= bucket_bound(bucket))
+	{
+		++bucket;
+	}
+
+	for (unsigned key = 0; key < ROLLUP_KEYS; ++key)
+	{
+		if (state.entries[key] != NULL)
+		{
+			++state.entries[key]->rtt[bucket];
+		}
+	}
+}
+
+
+
+uint64_t rollup_table::bucket_bound(unsigned bucket)
+{
+	return bucket < RTT_BUCKETS - 1 ? ((uint64_t) RTT_BUCKET_BASE) << bucket : UINT64_MAX;
+}
+
+
+
+/*
+ * Helper function to add an IP address (host order) to a string
+ */
+static void add_address(std::ostringstream& str, uint32_t addr)
+{
+	str << (addr >> 24) << "." << ((addr >> 16) & 0xff) << "." << ((addr >> 8) & 0xff) << "." << (addr & 0xff);
+}
+
+
+
+string rollup_table::key_str(rollup_key key, uint64_t value) const
+{
+	std::ostringstream str;
+
+	switch (key)
+	{
+		case ROLLUP_SUBNET:
+			add_address(str, value);
+			str << "/" << prefix;
+			break;
+
+		case ROLLUP_PORT:
+			str << "port " << value;
+			break;
+
+		case ROLLUP_PAIR:
+			add_address(str, value >> 32);
+			str << "<=>";
+			add_address(str, value & 0xffffffff);
+			break;
+
+		default:
+			break;
+	}
+
+	return str.str();
+}
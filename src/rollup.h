@@ -0,0 +1,117 @@
+#ifndef __ROLLUP_H__
+#define __ROLLUP_H__
+
+#include <tr1/cstdint>
+#include <tr1/unordered_map>
+#include <string>
+#include "flow.h"
+
+
+/*
+ * Number of RTT histogram buckets, and the upper bound of the first bucket
+ * (usecs). Every following bucket is twice as wide, the last one is open.
+ */
+#define RTT_BUCKETS 16
+#define RTT_BUCKET_BASE 128
+
+
+
+/*
+ * Rollup keys. Flows are rolled up by the roles of their endpoints, the
+ * server being the endpoint with the lower port (the lower address for equal
+ * ports). The trace filter drops connection setup, so the SYN direction is
+ * not known and servers on high ports are taken for clients.
+ */
+enum rollup_key
+{
+	ROLLUP_SUBNET,			// client subnet
+	ROLLUP_PORT,			// server port
+	ROLLUP_PAIR,			// client and server address
+	ROLLUP_KEYS
+};
+
+
+
+/*
+ * Statistics aggregated over all connections with the same rollup key, both
+ * directions included
+ */
+struct aggregate
+{
+	uint64_t connections;		// number of connections, counted by their flow from the client
+								// (the higher port), so a connection without one is not counted
+	uint64_t bytes;				// bytes sent
+	uint64_t retrans;			// retransmitted segments
+	uint64_t dupacks;			// duplicate ACKs
+	uint64_t rtt[RTT_BUCKETS];	// RTT samples per histogram bucket
+
+	aggregate();
+};
+
+
+
+/*
+ * The aggregates a flow is added to, and the counters of the flow that are
+ * already added, so only updates are added
+ */
+struct flowdata::rollup_state
+{
+	aggregate* entries[ROLLUP_KEYS];
+	uint64_t bytes;
+	uint32_t retrans;
+	uint32_t dupacks;
+};
+
+
+
+/*
+ * Rollups maintained while flows are updated, so aggregate reports need no
+ * pass over the flows. Each flow caches pointers to its aggregates, so an
+ * update costs no lookups.
+ */
+class rollup_table
+{
+	public:
+		rollup_table();
+
+		/* Roll up by a key, subnets by the given prefix length */
+		void enable(rollup_key key, unsigned prefix_len = 24);
+		inline bool enabled(rollup_key key) const
+		{
+			return active[key];
+		};
+
+		/* Add the updates of a flow since it was last added */
+		void update(const flow& conn, flowdata& data);
+
+		/* Add an RTT sample of a flow (usecs) */
+		void sample(const flow& conn, flowdata& data, uint64_t rtt);
+
+		/* Aggregates of a key, by numeric key */
+		typedef std::tr1::unordered_map< uint64_t, aggregate > aggregate_map;
+		inline const aggregate_map& aggregates(rollup_key key) const
+		{
+			return maps[key];
+		};
+
+		/* Human readable string of a numeric key */
+		std::string key_str(rollup_key key, uint64_t value) const;
+
+		/* Upper bound of an RTT histogram bucket (usecs), UINT64_MAX for the last */
+		static uint64_t bucket_bound(unsigned bucket);
+
+	private:
+		aggregate_map maps[ROLLUP_KEYS];
+		bool active[ROLLUP_KEYS];
+		unsigned prefix;		// subnet prefix length
+		uint32_t netmask;		// subnet mask (network order)
+
+		/* Find the aggregates of a flow */
+		flowdata::rollup_state& attach(const flow& conn, flowdata& data);
+
+		/* Rollup tables are not copyable */
+		rollup_table(const rollup_table& other);
+		rollup_table& operator=(const rollup_table& other);
+};
+
+#endif
@@ -0,0 +1,113 @@
+#ifndef __RTT_H__
+#define __RTT_H__
+
+#include <tr1/cstdint>
+#include <cmath>
+
+
+/*
+ * Number of outstanding TSvals remembered per flow
+ */
+#define TSVAL_SLOTS 32
+
+
+
+/*
+ * Running estimate of the round-trip time, fed one sample at a time.
+ * Mean and variance are kept with Welford's method.
+ */
+class rttstats
+{
+	public:
+		inline rttstats()
+			: n(0), lo(UINT64_MAX), hi(0), avg(0), m2(0)
+		{
+		};
+
+		/* Add an RTT sample (usecs) */
+		inline void sample(uint64_t rtt)
+		{
+			double delta = rtt - avg;
+
+			++n;
+			avg += delta / n;
+			m2 += delta * (rtt - avg);
+
+			if (rtt < lo)
+				lo = rtt;
+			if (rtt > hi)
+				hi = rtt;
+		};
+
+		inline uint32_t count() const { return n; };
+		inline uint64_t min() const { return lo; };
+		inline uint64_t max() const { return hi; };
+		inline double mean() const { return avg; };
+		inline double stddev() const { return n > 1 ? sqrt(m2 / (n - 1)) : 0; };
+
+	private:
+		uint32_t n;		// number of samples
+		uint64_t lo;	// smallest sample
+		uint64_t hi;	// largest sample
+		double avg;		// running mean
+		double m2;		// running sum of squared differences from the mean
+};
+
+
+
+/*
+ * A small direct-mapped table of TSvals sent and not yet echoed, used to
+ * match a TSecr with the time the echoed TSval was first sent in O(1).
+ */
+class tsval_table
+{
+	public:
+		inline tsval_table()
+		{
+			for (unsigned i = 0; i < TSVAL_SLOTS; ++i)
+			{
+				slots[i].time = 0;
+			}
+		};
+
+		/* Remember when a TSval was first sent */
+		inline void sent(uint32_t tsval, uint64_t time)
+		{
+			slot& s = slots[tsval % TSVAL_SLOTS];
+
+			if (s.time == 0 || s.tsval != tsval)
+			{
+				s.tsval = tsval;
+				s.time = time;
+			}
+		};
+
+		/*
+		 * Look up an echoed TSval and forget it, so that only the first
+		 * echo gives a sample. Returns false if the TSval is unknown.
+		 */
+		inline bool echoed(uint32_t tsecr, uint64_t& time)
+		{
+			slot& s = slots[tsecr % TSVAL_SLOTS];
+
+			if (s.time == 0 || s.tsval != tsecr)
+			{
+				return false;
+			}
+
+			time = s.time;
+			s.time = 0;
+			return true;
+		};
+
+	private:
+		struct slot
+		{
+			uint32_t tsval;
+			uint64_t time;		// time the TSval was first sent (0 if unused)
+		};
+
+		slot slots[TSVAL_SLOTS];
+};
+
+#endif
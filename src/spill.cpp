@@ -0,0 +1,175 @@
+#include "flow.h"
+#include "range.h"
+#include <vector>
+#include <stdexcept>
+#include <string>
+#include <cstring>
+#include <cerrno>
+#include <tr1/cstdint>
+#include <sys/time.h>
+#include <unistd.h>
+
+using std::vector;
+
+
+/*
+ * Estimated memory used by a byte range: the map node holding the range and
+ * its data, and the timestamps of a range that is sent and ACKed once
+ */
+#define RANGE_FOOTPRINT (4 * sizeof(void*) + sizeof(range) + sizeof(rangedata) + 2 * sizeof(timeval))
+
+
+
+/*
+ * Helpers to serialize plain values into a buffer
+ */
+template <typename T>
+static inline void put(vector<char>& buf, const T& value)
+{
+	const char* ptr = (const char*) &value;
+	buf.insert(buf.end(), ptr, ptr + sizeof(T));
+}
+
+template <typename T>
+static inline void get(const char*& ptr, T& value)
+{
+	memcpy(&value, ptr, sizeof(T));
+	ptr += sizeof(T);
+}
+
+
+
+/*
+ * Memory that spilling the flow would release. The flow record itself and
+ * its RTT and rollup state stay in memory, so they are not counted.
+ */
+uint64_t flowdata::memory_use() const
+{
+	return range_history().size() * RANGE_FOOTPRINT + retrans.capacity() * sizeof(episode);
+}
+
+
+
+/*
+ * Serialize the range data and retransmission episodes.
+ */
+void flowdata::pack(vector<char>& buf) const
+{
+	const range_map& ranges = range_history();
+	buf.clear();
+
+	put<uint32_t>(buf, ranges.size());
+	put<uint32_t>(buf, retrans.size());
+
+	for (range_map::const_iterator it = ranges.begin(); it != ranges.end(); ++it)
+	{
+		const rangedata& data = it->second;
+
+		put<uint64_t>(buf, it->first.seqno_lo);
+		put<uint64_t>(buf, it->first.seqno_hi);
+		put<uint32_t>(buf, data.sent.size());
+		put<uint32_t>(buf, data.ackd.size());
+
+		for (vector<timeval>::const_iterator ts = data.sent.begin(); ts != data.sent.end(); ++ts)
+			put<timeval>(buf, *ts);
+
+		for (vector<timeval>::const_iterator ts = data.ackd.begin(); ts != data.ackd.end(); ++ts)
+			put<timeval>(buf, *ts);
+	}
+
+	for (vector<episode>::const_iterator it = retrans.begin(); it != retrans.end(); ++it)
+	{
+		put<episode>(buf, *it);
+	}
+}
+
+
+
+/*
+ * Write the serialized range data and retransmission episodes to the spill
+ * store and release them from memory.
+ */
+void flowdata::spill(int fd, uint64_t offset, const vector<char>& buf)
+{
+	for (size_t written = 0; written < buf.size(); )
+	{
+		ssize_t n = pwrite(fd, &buf[written], buf.size() - written, offset + written);
+		if (n < 0)
+		{
+			throw std::runtime_error(std::string("Unable to spill flow: ") + strerror(errno));
+		}
+		written += n;
+	}
+
+	spill_off = offset;
+	spill_len = buf.size();
+
+	// Free the range history and swap with an empty vector to actually
+	// release the memory
+	delete range_data;
+	range_data = NULL;
+	vector<episode>().swap(retrans);
+}
+
+
+
+/*
+ * Read back spilled range data and retransmission episodes.
+ * This only uses pread(), so copies of spilled flows may be restored from
+ * several threads at once.
+ */
+void flowdata::restore(int fd)
+{
+	vector<char> buf(spill_len);
+
+	for (size_t done = 0; done < buf.size(); )
+	{
+		ssize_t n = pread(fd, &buf[done], buf.size() - done, spill_off + done);
+		if (n <= 0)
+		{
+			throw std::runtime_error(std::string("Unable to reload flow: ") + strerror(n < 0 ? errno : EIO));
+		}
+		done += n;
+	}
+
+	const char* ptr = &buf[0];
+	uint32_t num_ranges, num_episodes;
+	get(ptr, num_ranges);
+	get(ptr, num_episodes);
+
+	for (uint32_t i = 0; i < num_ranges; ++i)
+	{
+		uint64_t lo, hi;
+		uint32_t num_sent, num_ackd;
+		get(ptr, lo);
+		get(ptr, hi);
+		get(ptr, num_sent);
+		get(ptr, num_ackd);
+
+		// Ranges were written in order, so appending at the end is cheap
+		timeval ts;
+		ts.tv_sec = ts.tv_usec = 0;
+		range_map& ranges = range_store();
+		rangedata& data = ranges.insert(ranges.end(), range_map::value_type(range(lo, hi), rangedata(ts)))->second;
+
+		data.sent.resize(num_sent);
+		data.ackd.resize(num_ackd);
+
+		for (uint32_t j = 0; j < num_sent; ++j)
+			get(ptr, data.sent[j]);
+
+		for (uint32_t j = 0; j < num_ackd; ++j)
+			get(ptr, data.ackd[j]);
+	}
+
+	retrans.reserve(retrans.size() + num_episodes);
+	for (uint32_t i = 0; i < num_episodes; ++i)
+	{
+		episode e(episode::FAST, 0);
+		get(ptr, e);
+		retrans.push_back(e);
+	}
+
+	// The slot is kept, so the flow is spilled in place again if it still fits
+	spill_len = 0;
+}
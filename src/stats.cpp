@@ -5,11 +5,20 @@
 #include <sys/time.h>
 
 
+/* RTT estimate of flows without samples */
+const rttstats flowdata::no_samples;
+
+/* Range history of flows that don't track ranges */
+const flowdata::range_map flowdata::no_ranges;
+
+
+
 uint32_t flowdata::total_retrans() const
 {
 	uint32_t retr = 0;
 
 
+	const range_map& ranges = range_history();
 	for (range_map::const_iterator it = ranges.begin(); it != ranges.end(); it++)
 	{
 		int32_t retries = it->second.sent.size() - it->second.ackd.size();
@@ -26,6 +35,7 @@ uint32_t flowdata::max_num_retrans() const
 {
 	uint32_t max = 0;
 
+	const range_map& ranges = range_history();
 	for (range_map::const_iterator it = ranges.begin(); it != ranges.end(); it++)
 	{
 		int32_t size = it->second.sent.size() - it->second.ackd.size();
@@ -44,6 +54,7 @@ uint32_t flowdata::max_num_dupacks() const
 {
 	uint32_t dupacks = 0;
 
+	const range_map& ranges = range_history();
 	for (range_map::const_iterator it = ranges.begin(); it != ranges.end(); it++)
 	{
 		uint32_t n = it->second.ackd.size();
@@ -62,6 +73,7 @@ uint32_t flowdata::total_dupacks() const
 {
 	uint32_t dupacks = 0;
 
+	const range_map& ranges = range_history();
 	for (range_map::const_iterator it = ranges.begin(); it != ranges.end(); it++)
 	{
 		int32_t size = it->second.ackd.size() - it->second.sent.size();
@@ -77,6 +89,7 @@ uint64_t flowdata::unique_bytes_sent() const
 {
 	uint64_t byte_count = 0;
 
+	const range_map& ranges = range_history();
 	for (range_map::const_iterator it = ranges.begin(); it != ranges.end(); it++)
 	{
 		byte_count += it->first.seqno_hi - it->first.seqno_lo;
@@ -89,18 +102,22 @@ uint64_t flowdata::unique_bytes_sent() const
 
 uint64_t flowdata::rtt() const
 {
+	// Prefer samples from TCP timestamps, they are valid for retransmissions too
+	if (rtt_samples().count() > 0)
+	{
+		return rtt_samples().min();
+	}
+
 	uint64_t rtt = UINT64_MAX;
 
+	const range_map& ranges = range_history();
 	for (range_map::const_iterator it = ranges.begin(); it != ranges.end(); it++)
 	{
-		if (!it->second.ackd.empty())
+		// Retransmitted ranges have no sample, we can't tell which transmission was ACKed
+		uint64_t time = it->second.rtt_sample();
+		if (time < rtt)
 		{
-			const rangedata& data = it->second;
-			uint64_t time = USECS(data.ackd.back()) - USECS(data.sent.back());
-			if (time < rtt)
-			{
-				rtt = time;
-			}
+			rtt = time;
 		}
 	}
 
@@ -113,3 +130,37 @@ uint64_t flowdata::duration() const
 {
 	return USECS(ts_last) - USECS(ts_first);
 }
+
+
+
+uint32_t flowdata::num_episodes(episode::kind type) const
+{
+	uint32_t count = folded_episodes[type];
+
+	for (std::vector<episode>::const_iterator it = retrans.begin(); it != retrans.end(); ++it)
+	{
+		if (it->type == type)
+		{
+			++count;
+		}
+	}
+
+	return count;
+}
+
+
+
+uint64_t flowdata::episode_bytes(episode::kind type) const
+{
+	uint64_t bytes = folded_bytes[type];
+
+	for (std::vector<episode>::const_iterator it = retrans.begin(); it != retrans.end(); ++it)
+	{
+		if (it->type == type)
+		{
+			bytes += it->bytes;
+		}
+	}
+
+	return bytes;
+}
@@ -0,0 +1,430 @@
+#include "tcpstats.h"
+#include "flow.h"
+#include "trace.h"
+#include "report.h"
+#include <stdexcept>
+#include <exception>
+#include <string>
+#include <vector>
+#include <set>
+#include <new>
+#include <cstring>
+#include <tr1/cstdint>
+#include <netinet/tcp.h>
+
+using std::string;
+using std::vector;
+
+
+
+/*
+ * Magic numbers of pcap savefiles, with microsecond and nanosecond timestamps
+ */
+#define PCAP_MAGIC_USECS 0xa1b2c3d4
+#define PCAP_MAGIC_NSECS 0xa1b23c4d
+
+/*
+ * Size of the savefile header and of a record header
+ */
+#define PCAP_FILE_HEADER_SIZE 24
+#define PCAP_RECORD_HEADER_SIZE 16
+
+/*
+ * Largest record accepted from a savefile stream
+ */
+#define PCAP_MAX_RECORD (1 << 18)
+
+/*
+ * Ethernet link type of pcap savefiles
+ */
+#define PCAP_LINKTYPE_ETHERNET 1
+
+
+
+struct tcpstats_analyzer
+{
+	flow_table flows;
+	packet_stream stream;
+	tracking level;
+
+	tcpstats_flow_cb finished;		// callback for finished flows
+	void* finished_arg;
+	std::set<flow> fins;			// flows that have sent a FIN
+
+	vector<uint8_t> pending;		// savefile bytes not processed yet
+	bool header_seen;				// savefile header is processed
+	bool swapped;					// savefile byte order differs from ours
+	bool nsecs;						// savefile has nanosecond timestamps
+
+	string error;					// description of the last failure
+
+	inline tcpstats_analyzer(tracking level)
+		: stream(flows, level), level(level)
+		, finished(NULL), finished_arg(NULL)
+		, header_seen(false), swapped(false), nsecs(false)
+	{
+	};
+};
+
+
+
+/*
+ * Compute the statistics of a flow for the application
+ */
+static void export_flow(tcpstats_flow& out, const tcpstats_analyzer* a, flow_table::iterator it)
+{
+	flowstats stats;
+	stats.compute(a->flows, it.conn(), it.data(), a->level);
+
+	memset(&out, 0, sizeof(out));
+	out.src_addr = it.conn().src_addr();
+	out.dst_addr = it.conn().dst_addr();
+	out.src_port = it.conn().src_port();
+	out.dst_port = it.conn().dst_port();
+	out.unique_bytes = stats.unique_bytes;
+	out.retrans = stats.retrans;
+	out.max_retrans = stats.max_retrans;
+	out.dupacks = stats.dupacks;
+	out.max_dupacks = stats.max_dupacks;
+	out.rtt = stats.rtt != UINT64_MAX ? stats.rtt : 0;
+	out.rtt_samples = stats.rtt_samples.count();
+	if (out.rtt_samples > 0)
+	{
+		out.rtt_min = stats.rtt_samples.min();
+		out.rtt_max = stats.rtt_samples.max();
+		out.rtt_mean = stats.rtt_samples.mean();
+		out.rtt_stddev = stats.rtt_samples.stddev();
+	}
+	for (unsigned type = episode::FAST; type <= episode::SPURIOUS; ++type)
+	{
+		out.episodes[type] = stats.episodes[type];
+		out.episode_bytes[type] = stats.episode_bytes[type];
+	}
+	out.duration = stats.duration;
+}
+
+
+
+/*
+ * Report the flows of a finished connection that sent anything, starting
+ * with the given flow, and forget them
+ */
+static void finish_connection(tcpstats_analyzer* a, const flow& conn)
+{
+	flow reverse = conn.reverse();
+
+	// Forget the FINs even if the connection has no flows, so they can't
+	// tear down a later connection on the same addresses and ports
+	a->fins.erase(conn);
+	a->fins.erase(reverse);
+
+	flow_table::iterator it = a->flows.find(conn);
+	flow_table::iterator rev = a->flows.find(reverse);
+	if (it == a->flows.end() && rev == a->flows.end())
+	{
+		return;
+	}
+
+	if (a->finished != NULL)
+	{
+		tcpstats_flow stats;
+		if (it != a->flows.end())
+		{
+			export_flow(stats, a, it);
+			a->finished(&stats, a->finished_arg);
+		}
+		if (rev != a->flows.end())
+		{
+			export_flow(stats, a, rev);
+			a->finished(&stats, a->finished_arg);
+		}
+	}
+
+	a->flows.erase(conn);
+}
+
+
+
+/*
+ * Handle connection teardown
+ */
+static void teardown(tcpstats_analyzer* a, const timeval& ts, const uint8_t* frame, uint8_t flags)
+{
+	const uint8_t* ip = frame + ETHERNET_FRAME_SIZE;
+	const uint8_t* tcp = ip + (ip[0] & 0x0f) * 4;
+
+	flow sent(*((uint32_t*) (ip + 12)), *((uint16_t*) tcp), *((uint32_t*) (ip + 16)), *((uint16_t*) (tcp + 2)));
+
+	if (!(flags & TH_RST))
+	{
+		a->fins.insert(sent);
+		if (a->fins.find(sent.reverse()) == a->fins.end())
+			return;
+	}
+
+	// Queued segments may belong to the connection
+	a->stream.flush();
+
+	finish_connection(a, sent);
+
+	// Later segments of the connection, like the last ACK, must not recreate it
+	a->stream.ignore(sent, ts);
+}
+
+
+
+/*
+ * Push a frame, failures are thrown
+ */
+static void push_packet(tcpstats_analyzer* a, const timeval& ts, const uint8_t* frame, uint32_t caplen)
+{
+	uint8_t flags;
+
+	if (a->stream.push(ts, frame, caplen, flags) && (flags & (TH_FIN | TH_RST)))
+	{
+		teardown(a, ts, frame, flags);
+	}
+}
+
+
+
+/*
+ * Read a 32-bit word of a savefile
+ */
+static inline uint32_t savefile_word(const tcpstats_analyzer* a, const uint8_t* ptr)
+{
+	uint32_t word;
+	memcpy(&word, ptr, sizeof(word));
+	return a->swapped ? __builtin_bswap32(word) : word;
+}
+
+
+
+/*
+ * Process the complete records of the pending savefile bytes
+ */
+static void push_savefile(tcpstats_analyzer* a)
+{
+	vector<uint8_t>& buf = a->pending;
+	size_t off = 0;
+
+	if (!a->header_seen)
+	{
+		if (buf.size() < PCAP_FILE_HEADER_SIZE)
+			return;
+
+		uint32_t magic;
+		memcpy(&magic, &buf[0], sizeof(magic));
+
+		a->swapped = magic == __builtin_bswap32(PCAP_MAGIC_USECS) || magic == __builtin_bswap32(PCAP_MAGIC_NSECS);
+		magic = savefile_word(a, &buf[0]);
+
+		if (magic != PCAP_MAGIC_USECS && magic != PCAP_MAGIC_NSECS)
+		{
+			throw std::runtime_error("Not a pcap savefile");
+		}
+
+		if ((savefile_word(a, &buf[20]) & 0x0fffffff) != PCAP_LINKTYPE_ETHERNET)
+		{
+			throw std::runtime_error("Only Ethernet captures are supported");
+		}
+
+		a->nsecs = magic == PCAP_MAGIC_NSECS;
+		a->header_seen = true;
+		off = PCAP_FILE_HEADER_SIZE;
+	}
+
+	while (buf.size() - off >= PCAP_RECORD_HEADER_SIZE)
+	{
+		timeval ts;
+		ts.tv_sec = savefile_word(a, &buf[off]);
+		ts.tv_usec = savefile_word(a, &buf[off + 4]);
+		uint32_t caplen = savefile_word(a, &buf[off + 8]);
+
+		if (a->nsecs)
+			ts.tv_usec /= 1000;
+
+		if (caplen > PCAP_MAX_RECORD)
+		{
+			throw std::runtime_error("Invalid savefile record");
+		}
+
+		if (buf.size() - off - PCAP_RECORD_HEADER_SIZE < caplen)
+			break;
+
+		push_packet(a, ts, &buf[off + PCAP_RECORD_HEADER_SIZE], caplen);
+		off += PCAP_RECORD_HEADER_SIZE + caplen;
+	}
+
+	buf.erase(buf.begin(), buf.begin() + off);
+}
+
+
+
+tcpstats_analyzer* tcpstats_create(enum tcpstats_tracking level)
+{
+	tracking track;
+
+	switch (level)
+	{
+		case TCPSTATS_TRACK_COUNTERS:
+			track = TRACK_COUNTERS;
+			break;
+
+		case TCPSTATS_TRACK_RTT:
+			track = TRACK_RTT;
+			break;
+
+		default:
+			track = TRACK_RANGES;
+			break;
+	}
+
+	return new (std::nothrow) tcpstats_analyzer(track);
+}
+
+
+
+void tcpstats_destroy(tcpstats_analyzer* a)
+{
+	delete a;
+}
+
+
+
+const char* tcpstats_error(const tcpstats_analyzer* a)
+{
+	return a->error.c_str();
+}
+
+
+
+int tcpstats_set_memory_limit(tcpstats_analyzer* a, uint64_t bytes)
+{
+	try
+	{
+		a->flows.set_memory_limit(bytes);
+		return 0;
+	}
+	catch (const std::exception& e)
+	{
+		a->error = e.what();
+		return -1;
+	}
+}
+
+
+
+int tcpstats_set_dedup_window(tcpstats_analyzer* a, uint64_t window)
+{
+	try
+	{
+		a->stream.set_dedup_window(window);
+		return 0;
+	}
+	catch (const std::exception& e)
+	{
+		a->error = e.what();
+		return -1;
+	}
+}
+
+
+
+uint64_t tcpstats_duplicates(const tcpstats_analyzer* a)
+{
+	return a->stream.dropped();
+}
+
+
+
+uint32_t tcpstats_flows(const tcpstats_analyzer* a)
+{
+	return a->flows.count();
+}
+
+
+
+void tcpstats_on_finished(tcpstats_analyzer* a, tcpstats_flow_cb callback, void* arg)
+{
+	a->finished = callback;
+	a->finished_arg = arg;
+}
+
+
+
+int tcpstats_push_packet(tcpstats_analyzer* a, const struct timeval* ts, const uint8_t* frame, uint32_t caplen)
+{
+	try
+	{
+		push_packet(a, *ts, frame, caplen);
+		return 0;
+	}
+	catch (const std::exception& e)
+	{
+		a->error = e.what();
+		return -1;
+	}
+}
+
+
+
+int tcpstats_push_buffer(tcpstats_analyzer* a, const void* data, size_t length)
+{
+	try
+	{
+		a->pending.insert(a->pending.end(), (const uint8_t*) data, (const uint8_t*) data + length);
+		push_savefile(a);
+		return 0;
+	}
+	catch (const std::exception& e)
+	{
+		a->error = e.what();
+		return -1;
+	}
+}
+
+
+
+int tcpstats_poll(tcpstats_analyzer* a, tcpstats_flow_cb callback, void* arg)
+{
+	try
+	{
+		a->stream.flush();
+
+		for (flow_table::iterator it = a->flows.begin(); it != a->flows.end(); ++it)
+		{
+			tcpstats_flow stats;
+			export_flow(stats, a, it);
+			callback(&stats, arg);
+		}
+		return 0;
+	}
+	catch (const std::exception& e)
+	{
+		a->error = e.what();
+		return -1;
+	}
+}
+
+
+
+int tcpstats_finish(tcpstats_analyzer* a)
+{
+	try
+	{
+		a->stream.flush();
+
+		while (a->flows.begin() != a->flows.end())
+		{
+			flow conn = a->flows.begin().conn();
+			finish_connection(a, conn);
+		}
+		return 0;
+	}
+	catch (const std::exception& e)
+	{
+		a->error = e.what();
+		return -1;
+	}
+}
@@ -0,0 +1,158 @@
+#ifndef __TCPSTATS_H__
+#define __TCPSTATS_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/time.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+
+
+/*
+ * Version of the library API, incremented on incompatible changes
+ */
+#define TCPSTATS_API_VERSION 1
+
+
+
+/*
+ * libtcpstats analyzes TCP flows from packets pushed by the application.
+ *
+ * Each analyzer is independent, so several analyzers can be used in the same
+ * process. An analyzer must not be used by more than one thread at a time.
+ * Functions returning int return 0 on success and -1 on failure, the reason
+ * of the last failure is given by tcpstats_error().
+ */
+typedef struct tcpstats_analyzer tcpstats_analyzer;
+
+
+
+/*
+ * How much state is kept per flow
+ */
+enum tcpstats_tracking
+{
+	TCPSTATS_TRACK_COUNTERS,		// byte, retransmission and duplicate ACK counters
+	TCPSTATS_TRACK_RTT,				// counters and RTT samples from TCP timestamps
+	TCPSTATS_TRACK_RANGES			// counters, RTT samples and full range history
+};
+
+
+
+/*
+ * Retransmission episode kinds, used to index tcpstats_flow.episodes
+ */
+enum tcpstats_episode
+{
+	TCPSTATS_EPISODE_FAST,			// fast retransmit after duplicate ACKs
+	TCPSTATS_EPISODE_TIMEOUT,		// retransmit without preceding duplicate ACKs
+	TCPSTATS_EPISODE_SPURIOUS		// retransmit of data that was already acknowledged
+};
+
+
+
+/*
+ * Statistics of a flow, one direction of a TCP connection.
+ * Addresses and ports are in network byte order, times in microseconds.
+ * The max_* fields are only computed when tracking ranges.
+ */
+struct tcpstats_flow
+{
+	uint32_t src_addr;
+	uint32_t dst_addr;
+	uint16_t src_port;
+	uint16_t dst_port;
+	uint64_t unique_bytes;			// number of unique bytes sent
+	uint32_t retrans;				// total number of retransmissions
+	uint32_t max_retrans;			// highest number of retransmissions of a range
+	uint32_t dupacks;				// total number of duplicate ACKs
+	uint32_t max_dupacks;			// highest number of duplicate ACKs of a range
+	uint64_t rtt;					// round-trip time (0 if not measured)
+	uint32_t rtt_samples;			// number of RTT samples from TCP timestamps
+	uint64_t rtt_min;				// RTT sample statistics (0 without samples)
+	uint64_t rtt_max;
+	double rtt_mean;
+	double rtt_stddev;
+	uint32_t episodes[3];			// retransmission episodes per tcpstats_episode
+	uint64_t episode_bytes[3];		// bytes retransmitted per tcpstats_episode
+	uint64_t duration;				// time between the first and the last segment
+};
+
+
+
+/* Called with the statistics of a flow */
+typedef void (*tcpstats_flow_cb)(const struct tcpstats_flow* flow, void* arg);
+
+
+
+/* Create an analyzer, returns NULL if out of memory */
+tcpstats_analyzer* tcpstats_create(enum tcpstats_tracking level);
+
+/* Destroy an analyzer, without reporting the remaining flows */
+void tcpstats_destroy(tcpstats_analyzer* analyzer);
+
+/* Description of the last failure */
+const char* tcpstats_error(const tcpstats_analyzer* analyzer);
+
+/*
+ * Limit the (approximate) memory used by the range data and retransmission
+ * episodes of flows, spilling them for the least recently active flows to a
+ * temporary file when exceeded (0 is unlimited, at least 64K otherwise)
+ */
+int tcpstats_set_memory_limit(tcpstats_analyzer* analyzer, uint64_t bytes);
+
+/*
+ * Drop copies of packets seen within a time window (usecs, 0 keeps all), such
+ * as frames delivered more than once by a mirror port
+ */
+int tcpstats_set_dedup_window(tcpstats_analyzer* analyzer, uint64_t window);
+
+/* Number of duplicate packets dropped */
+uint64_t tcpstats_duplicates(const tcpstats_analyzer* analyzer);
+
+/*
+ * Number of flows currently tracked: two per open connection, or one if it
+ * was only seen in one direction
+ */
+uint32_t tcpstats_flows(const tcpstats_analyzer* analyzer);
+
+/*
+ * Register a callback for finished flows.
+ * A connection is finished when both sides have sent a FIN or either side
+ * has sent a RST. Its flows that sent anything are then reported and
+ * forgotten.
+ */
+void tcpstats_on_finished(tcpstats_analyzer* analyzer, tcpstats_flow_cb callback, void* arg);
+
+/*
+ * Push a captured Ethernet frame.
+ * Frames that are not IPv4 TCP segments are ignored.
+ */
+int tcpstats_push_packet(tcpstats_analyzer* analyzer, const struct timeval* timestamp, const uint8_t* frame, uint32_t caplen);
+
+/*
+ * Push the next bytes of a pcap savefile stream (Ethernet link type).
+ * Buffers may split the file at any point, incomplete records are kept until
+ * the rest of them is pushed.
+ */
+int tcpstats_push_buffer(tcpstats_analyzer* analyzer, const void* data, size_t length);
+
+/*
+ * Call the callback with the current statistics of every flow, in order, the
+ * two flows of a connection in a row
+ */
+int tcpstats_poll(tcpstats_analyzer* analyzer, tcpstats_flow_cb callback, void* arg);
+
+/* End of input, report all remaining flows as finished */
+int tcpstats_finish(tcpstats_analyzer* analyzer);
+
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -1,15 +1,24 @@
 #include "trace.h"
 #include "flow.h"
+#include "registry.h"
+#include "dedup.h"
+#include "rollup.h"
+#include "decompress.h"
 #include <stdexcept>
 #include <string>
 #include <pcap.h>
 #include <tr1/cstdint>
 #include <arpa/inet.h>
+#include <netinet/tcp.h>
 #include <cstdio>
+#include <sstream>
+#include <vector>
+#include <algorithm>
 #include <assert.h>
 
 
 using std::string;
+using std::vector;
 
 
 
@@ -33,109 +42,995 @@ static void set_filter(pcap_t* handle, const char* filter)
 
 
 
-static void process_sent(pcap_t* handle)
+/*
+ * Number of packets decoded and looked up together before updating flows
+ */
+#define BATCH_SIZE 64
+
+/*
+ * How long a live stream may be quiet before a partial batch is ingested
+ * (usecs), so published flows never lag behind by more than this
+ */
+#define FLUSH_INTERVAL 100000
+
+
+
+/*
+ * How long the segments of a closed connection are ignored (usecs), twice
+ * the maximum segment lifetime of common stacks
+ */
+#define CLOSED_LINGER 60000000
+
+
+
+/*
+ * Set to stop the ongoing analysis
+ */
+static volatile bool stopping = false;
+
+
+
+/*
+ * The fields of a TCP segment needed to update a flow
+ */
+struct segment
+{
+	timeval ts;			// capture timestamp
+	uint32_t src_addr;		// source IP address
+	uint32_t dst_addr;		// destination IP address
+	uint16_t src_port;		// source port
+	uint16_t dst_port;		// destination port
+	uint32_t seq_no;		// TCP sequence number
+	uint32_t ack_no;		// TCP acknowledgement number
+	uint16_t data_len;		// TCP payload length
+	bool has_ts;			// TCP timestamp option present
+	uint32_t tsval;			// TCP timestamp value
+	uint32_t tsecr;			// TCP timestamp echo reply
+	const flow* sent_conn;	// the flow this segment carries data for
+	const flow* ackd_conn;	// the flow this segment acknowledges
+	flowdata* sent;
+	flowdata* ackd;
+};
+
+
+
+/*
+ * Decode the headers of a packet into a segment.
+ * TCP options are only decoded if the tracking policy needs them.
+ */
+template <class policy>
+static inline void decode(segment& seg, const pcap_pkthdr* hdr, const u_char* pkt)
+{
+	// Find offset to TCP header and TCP payload
+	uint32_t tcp_off = (*((uint8_t*) pkt + ETHERNET_FRAME_SIZE) & 0x0f) * 4; // IP header size = offset to IP payload/TCP header
+	uint32_t data_off = ((*((uint8_t*) (pkt + ETHERNET_FRAME_SIZE + tcp_off + 12)) & 0xf0) >> 4) * 4; // TCP header size = offset to TCP payload
+
+	seg.ts = hdr->ts;
+
+	// Find IP addresses and TCP ports
+	seg.src_addr = *((uint32_t*) (pkt + ETHERNET_FRAME_SIZE + 12)); // source address
+	seg.dst_addr = *((uint32_t*) (pkt + ETHERNET_FRAME_SIZE + 16)); // destination address
+	seg.src_port = *((uint16_t*) (pkt + ETHERNET_FRAME_SIZE + tcp_off)); // source port
+	seg.dst_port = *((uint16_t*) (pkt + ETHERNET_FRAME_SIZE + tcp_off + 2)); // destination port
+
+	// Find TCP sequence and acknowledgement number
+	seg.seq_no = ntohl(*((uint32_t*) (pkt + ETHERNET_FRAME_SIZE + tcp_off + 4))); // TCP sequence number
+	seg.ack_no = ntohl(*((uint32_t*) (pkt + ETHERNET_FRAME_SIZE + tcp_off + 8))); // TCP acknowledgement number
+
+	// Find TCP payload length
+	seg.data_len = ntohs(*((uint16_t*) (pkt + ETHERNET_FRAME_SIZE + 2))) - tcp_off - data_off; // Ethernet frame size - total size of headers
+
+	// Find TCP timestamp option
+	seg.has_ts = false;
+	if (!policy::rtt)
+	{
+		return;
+	}
+
+	const u_char* opt = pkt + ETHERNET_FRAME_SIZE + tcp_off + 20;
+	const u_char* opt_end = pkt + ETHERNET_FRAME_SIZE + tcp_off + data_off;
+	if (opt_end > pkt + hdr->caplen)
+	{
+		opt_end = pkt + hdr->caplen;
+	}
+
+	while (opt < opt_end && *opt != TCPOPT_EOL)
+	{
+		if (*opt == TCPOPT_NOP)
+		{
+			++opt;
+			continue;
+		}
+
+		if (opt + 1 >= opt_end || opt[1] < 2 || opt + opt[1] > opt_end)
+		{
+			break;
+		}
+
+		if (*opt == TCPOPT_TIMESTAMP && opt[1] == TCPOLEN_TIMESTAMP)
+		{
+			seg.has_ts = true;
+			seg.tsval = ntohl(*((uint32_t*) (opt + 2)));
+			seg.tsecr = ntohl(*((uint32_t*) (opt + 6)));
+			break;
+		}
+
+		opt += opt[1];
+	}
+}
+
+
+
+/*
+ * Allowed disorder of packet timestamps in a trace (usecs), when seeking to
+ * and stopping at the boundaries of a time window
+ */
+#define ORDER_SLACK 1000000
+
+
+
+/*
+ * A capture file merged with others
+ */
+struct input
+{
+	pcap_t* handle;
+	pcap_pkthdr* hdr;		// next packet of the file
+	const u_char* pkt;
+};
+
+
+
+/*
+ * Heap order of inputs, the input with the earliest next packet on top
+ */
+struct later_packet
+{
+	const vector<input>* inputs;
+
+	inline bool operator()(unsigned a, unsigned b) const
+	{
+		const timeval& ta = (*inputs)[a].hdr->ts;
+		const timeval& tb = (*inputs)[b].hdr->ts;
+
+		if (ta.tv_sec != tb.tv_sec)
+			return ta.tv_sec > tb.tv_sec;
+		if (ta.tv_usec != tb.tv_usec)
+			return ta.tv_usec > tb.tv_usec;
+		return a > b;
+	};
+};
+
+
+
+/*
+ * A source of packets to analyze
+ */
+struct source
+{
+	flow_table* flows;				// where the segments are ingested
+	pcap_t* handle;
+	FILE* fp;
+	uint64_t start;					// skip packets before this time (usecs)
+	uint64_t end;					// stop at packets after this time (usecs)
+
+	const vector<uint64_t>* offsets;	// if set, only read the records at these offsets
+	size_t next_offset;
+
+	trace_index* index;				// if set, index every packet matching indexed
+	bpf_program indexed;			// packets to add to the index
+	bpf_program analyzed;			// packets to analyze (while indexing)
+
+	vector<FILE*> files;			// the files read
+	vector<input> inputs;			// if more than one, files merged by timestamp
+	vector<unsigned> pending;		// heap of inputs with a next packet
+	unsigned current;				// input of the last packet read
+	duplicate_filter* duplicates;	// if set, drop copies of packets
+};
+
+
+
+/*
+ * Read the next record of a file, returns false at the end of the file.
+ * Read errors, such as a truncated file, are thrown rather than taken as the end.
+ */
+static inline bool next_record(pcap_t* handle, pcap_pkthdr*& hdr, const u_char*& pkt)
+{
+	int status = pcap_next_ex(handle, &hdr, &pkt);
+
+	if (status == -1 && !stopping)
+	{
+		throw std::runtime_error(string(pcap_geterr(handle)));
+	}
+
+	return status == 1;
+}
+
+
+
+/*
+ * Read the next record of a source.
+ * Multiple files are merged by timestamp, reading ahead a single record per
+ * file. A record stays valid until the next record is read from its file, so
+ * a file is only advanced when the next record is asked for.
+ */
+static bool read_packet(source& src, pcap_pkthdr*& hdr, const u_char*& pkt)
+{
+	if (src.inputs.size() < 2)
+	{
+		return next_record(src.handle, hdr, pkt);
+	}
+
+	later_packet order;
+	order.inputs = &src.inputs;
+
+	if (src.current < src.inputs.size())
+	{
+		input& in = src.inputs[src.current];
+		if (next_record(in.handle, in.hdr, in.pkt))
+		{
+			src.pending.push_back(src.current);
+			std::push_heap(src.pending.begin(), src.pending.end(), order);
+		}
+		src.current = src.inputs.size();
+	}
+
+	if (src.pending.empty())
+	{
+		return false;
+	}
+
+	std::pop_heap(src.pending.begin(), src.pending.end(), order);
+	src.current = src.pending.back();
+	src.pending.pop_back();
+
+	hdr = src.inputs[src.current].hdr;
+	pkt = src.inputs[src.current].pkt;
+	return true;
+}
+
+
+
+/*
+ * Read the next packet to analyze.
+ */
+static bool next_packet(source& src, pcap_pkthdr*& hdr, const u_char*& pkt)
+{
+	while (!stopping)
+	{
+		long offset = 0;
+
+		if (src.offsets != NULL)
+		{
+			if (src.next_offset == src.offsets->size())
+				return false;
+
+			fseek(src.fp, (*src.offsets)[src.next_offset++], SEEK_SET);
+		}
+		else if (src.index != NULL)
+		{
+			offset = ftell(src.fp);
+		}
+
+		if (!read_packet(src, hdr, pkt))
+		{
+			return false;
+		}
+
+		if (src.index != NULL)
+		{
+			if (!pcap_offline_filter(&src.indexed, hdr, pkt))
+				continue;
+
+			segment seg;
+			decode<track_counters>(seg, hdr, pkt);
+			src.index->add(offset, hdr->ts, seg.src_addr, seg.src_port, seg.dst_addr, seg.dst_port);
+
+			if (!pcap_offline_filter(&src.analyzed, hdr, pkt))
+				continue;
+		}
+
+		uint64_t ts = USECS(hdr->ts);
+
+		if (ts < src.start)
+			continue;
+
+		if (ts > src.end)
+		{
+			// When reading sequentially, stop once we are well past the window
+			if (src.offsets == NULL && src.index == NULL && ts - src.end > ORDER_SLACK)
+				return false;
+			continue;
+		}
+
+		if (src.duplicates != NULL && src.duplicates->duplicate(hdr->ts, pkt, hdr->caplen))
+			continue;
+
+		return true;
+	}
+
+	return false;
+}
+
+
+
+/*
+ * Read and decode up to BATCH_SIZE packets.
+ * The packet buffer is only valid until the next read, so every packet is
+ * decoded right away.
+ */
+template <class policy>
+static unsigned read_batch(source& src, segment* batch)
 {
 	pcap_pkthdr* hdr;
 	const u_char* pkt;
+	unsigned count = 0;
+
+	while (count < BATCH_SIZE && next_packet(src, hdr, pkt))
+	{
+		decode<policy>(batch[count++], hdr, pkt);
+	}
+
+	return count;
+}
+
+
+
+/*
+ * Locate the flows of a batch.
+ * Every segment updates both the flow it carries data for and the opposite
+ * flow it acknowledges, which are found with one lookup of their connection.
+ * Consecutive segments of the same connection share lookups.
+ */
+static void lookup_batch(flow_table& flows, segment* batch, unsigned count)
+{
+	for (unsigned i = 0; i < count; ++i)
+	{
+		segment& seg = batch[i];
+
+		if (i > 0
+				&& seg.src_addr == batch[i-1].src_addr && seg.dst_addr == batch[i-1].dst_addr
+				&& seg.src_port == batch[i-1].src_port && seg.dst_port == batch[i-1].dst_port)
+		{
+			seg.sent_conn = batch[i-1].sent_conn;
+			seg.ackd_conn = batch[i-1].ackd_conn;
+			seg.sent = batch[i-1].sent;
+			seg.ackd = batch[i-1].ackd;
+			continue;
+		}
+
+		if (i > 0
+				&& seg.src_addr == batch[i-1].dst_addr && seg.dst_addr == batch[i-1].src_addr
+				&& seg.src_port == batch[i-1].dst_port && seg.dst_port == batch[i-1].src_port)
+		{
+			// The opposite direction of the same connection
+			seg.sent_conn = batch[i-1].ackd_conn;
+			seg.ackd_conn = batch[i-1].sent_conn;
+			seg.sent = batch[i-1].ackd;
+			seg.ackd = batch[i-1].sent;
+			continue;
+		}
+
+		flows.find_connection(seg.sent_conn, seg.sent, seg.ackd_conn, seg.ackd, seg.src_addr, seg.src_port, seg.dst_addr, seg.dst_port);
+	}
+}
+
+
+
+/*
+ * Ingest a batch of segments, keeping the state selected by the tracking
+ * policy.
+ */
+template <class policy>
+static void process_batch(flow_table& flows, segment* batch, unsigned count)
+{
+	rollup_table* rollups = flows.rollups();
+	uint64_t rtt;
+
+	lookup_batch(flows, batch, count);
+
+	// Update connection data
+	for (unsigned i = 0; i < count; ++i)
+	{
+		segment& seg = batch[i];
+
+		seg.sent->register_sent<policy>(seg.seq_no, seg.seq_no + seg.data_len, seg.ts);
+		seg.ackd->register_ack<policy>(seg.ack_no, seg.data_len, seg.ts);
 
-	flowdata* data;
-	const flow* conn;
+		if (policy::rtt && seg.has_ts)
+		{
+			if (seg.data_len > 0)
+				seg.sent->register_tsval(seg.tsval, seg.ts);
 
-	while (pcap_next_ex(handle, &hdr, &pkt) == 1)
+			if (seg.ackd->register_tsecr(seg.tsecr, seg.ts, rtt) && rollups != NULL)
+				rollups->sample(*seg.ackd_conn, *seg.ackd, rtt);
+		}
+	}
+
+	// Add the updates to the rollups
+	if (rollups != NULL)
 	{
-		// Find offset to TCP header and TCP payload
-		uint32_t tcp_off = (*((uint8_t*) pkt + ETHERNET_FRAME_SIZE) & 0x0f) * 4; // IP header size = offset to IP payload/TCP header
-		uint32_t data_off = ((*((uint8_t*) (pkt + ETHERNET_FRAME_SIZE + tcp_off + 12)) & 0xf0) >> 4) * 4; // TCP header size = offset to TCP payload
+		for (unsigned i = 0; i < count; ++i)
+		{
+			// The next segment updates the same connection
+			if (i + 1 < count && (batch[i].sent == batch[i+1].sent || batch[i].sent == batch[i+1].ackd))
+				continue;
 
-		// Find IP addresses and TCP ports
-		uint32_t src_addr = *((uint32_t*) (pkt + ETHERNET_FRAME_SIZE + 12)); // source address
-		uint32_t dst_addr = *((uint32_t*) (pkt + ETHERNET_FRAME_SIZE + 16)); // destination address
-		uint16_t src_port = *((uint16_t*) (pkt + ETHERNET_FRAME_SIZE + tcp_off)); // source port
-		uint16_t dst_port = *((uint16_t*) (pkt + ETHERNET_FRAME_SIZE + tcp_off + 2)); // destination port
+			rollups->update(*batch[i].sent_conn, *batch[i].sent);
+			rollups->update(*batch[i].ackd_conn, *batch[i].ackd);
+		}
+	}
 
-		// Find TCP sequence number
-		uint32_t seq_no = ntohl(*((uint32_t*) (pkt + ETHERNET_FRAME_SIZE + tcp_off + 4))); // TCP sequence number
+	// Make the updated statistics visible to queries, before any flow of the
+	// batch may be spilled
+	registry* summaries = flows.summaries();
+	if (summaries != NULL)
+	{
+		for (unsigned i = 0; i < count; ++i)
+		{
+			// The next segment updates the same connection
+			if (i + 1 < count && (batch[i].sent == batch[i+1].sent || batch[i].sent == batch[i+1].ackd))
+				continue;
 
-		// Find TCP payload length
-		uint16_t data_len = ntohs(*((uint16_t*) (pkt + ETHERNET_FRAME_SIZE + 2))) - tcp_off - data_off; // Ethernet frame size - total size of headers
-		
-		// Locate connection and update connection data
-		flow::find_connection(conn, data, src_addr, src_port, dst_addr, dst_port);
-		data->register_sent(seq_no, seq_no + data_len, hdr->ts);
+			summaries->publish(*batch[i].sent_conn, *batch[i].sent);
+			summaries->publish(*batch[i].ackd_conn, *batch[i].ackd);
+		}
+	}
+
+	// Spill idle flows to disk if the batch pushed us over the memory limit
+	if (flows.memory_limited())
+	{
+		for (unsigned i = 0; i < count; ++i)
+		{
+			flows.account(*batch[i].sent);
+			flows.account(*batch[i].ackd);
+		}
+
+		flows.enforce_memory_limit();
 	}
 }
 
 
 
+/*
+ * The batch of a live source
+ */
+struct live_batch
+{
+	flow_table* flows;
+	segment segments[BATCH_SIZE];
+	unsigned count;
+	string error;			// the first ingestion failure
+};
+
+
+
+/*
+ * Ingest the segments of a live batch.
+ * Failures are kept for the reading loop to throw, as this also runs from
+ * within a read.
+ */
+template <class policy>
+static void flush_live(void* arg)
+{
+	live_batch& live = *((live_batch*) arg);
+
+	if (live.count == 0)
+	{
+		return;
+	}
+
+	try
+	{
+		process_batch<policy>(*live.flows, live.segments, live.count);
+	}
+	catch (const std::runtime_error& e)
+	{
+		if (live.error.empty())
+			live.error = e.what();
+	}
+
+	live.count = 0;
+}
+
+
 
-static void process_acks(pcap_t* handle)
+/*
+ * Ingest all segments from a source whose flows are published.
+ * Segments are batched as usual, but a partial batch is ingested by the
+ * reading thread itself once a read has waited for a flush interval, so
+ * queries see every packet read.
+ */
+template <class policy>
+static void process_live(source& src)
 {
+	live_batch live;
 	pcap_pkthdr* hdr;
 	const u_char* pkt;
 
-	flowdata* data;
-	const flow* conn;
+	live.flows = src.flows;
+	live.count = 0;
+
+	for (size_t i = 0; i < src.files.size(); ++i)
+	{
+		watch_trace(src.files[i], FLUSH_INTERVAL, flush_live<policy>, &live);
+	}
+
+	string error;
+
+	try
+	{
+		// A quiet read may flush the batch, so the next segment is placed after reading
+		while (live.error.empty() && next_packet(src, hdr, pkt))
+		{
+			decode<policy>(live.segments[live.count++], hdr, pkt);
+			if (live.count == BATCH_SIZE)
+			{
+				flush_live<policy>(&live);
+			}
+		}
+	}
+	catch (const std::runtime_error& e)
+	{
+		error = e.what();
+	}
+
+	for (size_t i = 0; i < src.files.size(); ++i)
+	{
+		watch_trace(src.files[i], 0, NULL, NULL);
+	}
+
+	flush_live<policy>(&live);
+
+	if (!live.error.empty())
+	{
+		throw std::runtime_error(live.error);
+	}
+	if (!error.empty())
+	{
+		throw std::runtime_error(error);
+	}
+}
+
+
+
+/*
+ * Ingest all segments from a source.
+ */
+template <class policy>
+static void process_segments(source& src)
+{
+	segment batch[BATCH_SIZE];
+	unsigned count;
 
-	while (pcap_next_ex(handle, &hdr, &pkt) == 1)
+	if (src.flows->summaries() != NULL)
 	{
-		// Find offset to TCP header and TCP payload
-		uint32_t tcp_off = (*((uint8_t*) pkt + ETHERNET_FRAME_SIZE) & 0x0f) * 4; // IP header size = offset to IP payload/TCP header
+		process_live<policy>(src);
+		return;
+	}
+
+	while ((count = read_batch<policy>(src, batch)) > 0)
+	{
+		process_batch<policy>(*src.flows, batch, count);
+	}
+}
 
-		// Find IP addresses and TCP ports
-		uint32_t src_addr = *((uint32_t*) (pkt + ETHERNET_FRAME_SIZE + 12)); // source address
-		uint32_t dst_addr = *((uint32_t*) (pkt + ETHERNET_FRAME_SIZE + 16)); // destination address
-		uint16_t src_port = *((uint16_t*) (pkt + ETHERNET_FRAME_SIZE + tcp_off)); // source port
-		uint16_t dst_port = *((uint16_t*) (pkt + ETHERNET_FRAME_SIZE + tcp_off + 2)); // destination port
 
-		// Find TCP acknowledgement number
-		uint32_t ack_no = ntohl(*((uint32_t*) (pkt + ETHERNET_FRAME_SIZE + tcp_off + 8))); // TCP acknowledgement number
 
-		// Locate connection and update connection data
-		flow::find_connection(conn, data, dst_addr, dst_port, src_addr, src_port);
-		data->register_ack(ack_no, hdr->ts);
+/*
+ * Select the ingestion path of a tracking level.
+ */
+static void process_trace(source& src, tracking level)
+{
+	switch (level)
+	{
+		case TRACK_COUNTERS:
+			process_segments<track_counters>(src);
+			break;
+
+		case TRACK_RTT:
+			process_segments<track_rtt>(src);
+			break;
+
+		case TRACK_RANGES:
+			process_segments<track_ranges>(src);
+			break;
 	}
 }
 
 
 
-void analyze_trace(FILE* fp, const filter& filter)
+/*
+ * Packets that are analyzed: TCP segments that are not part of connection
+ * setup or teardown, and that carry an ACK
+ */
+static const char* const segment_filter = " and tcp[tcpflags] & (tcp-syn|tcp-fin) = 0 and tcp[tcpflags] & (tcp-ack) != 0";
+
+
+
+static pcap_t* open_handle(FILE* fp)
 {
-	string filterstr;
 	char errbuf[PCAP_ERRBUF_SIZE];
 	pcap_t* handle;
 
 	// FIXME: Do a call to pcap_next_ex and find the first timestamp
 
-	rewind(fp);
+	// Data and acknowledgements are handled in a single pass over the trace,
+	// so the trace may be a stream that can't be rewound
    	if ((handle = pcap_fopen_offline(fp, errbuf)) == NULL)
 	{
 		throw std::runtime_error(string(errbuf));
 	}
 
-	filterstr = filter.str();
-	filterstr += " and tcp[tcpflags] & (tcp-syn|tcp-fin) = 0 and tcp[tcpflags] & (tcp-ack) != 0";
-	set_filter(handle, filterstr.c_str());
+	return handle;
+}
 
-	process_sent(handle);
 
-	rewind(fp);
-   	if ((handle = pcap_fopen_offline(fp, errbuf)) == NULL)
+
+static void compile_filter(pcap_t* handle, bpf_program& prog, const string& filter)
+{
+	if (pcap_compile(handle, &prog, filter.c_str(), 0, PCAP_NETMASK_UNKNOWN) == -1)
 	{
-		throw std::runtime_error(string(errbuf));
+		throw std::runtime_error(string(pcap_geterr(handle)));
+	}
+}
+
+
+
+uint64_t analyze_trace(flow_table& flows, const vector<FILE*>& trace_files, const filter& filter, tracking level, const trace_index* index)
+{
+	vector<uint64_t> offsets;
+	duplicate_filter duplicates(filter.dedup_window);
+	source src;
+
+	src.flows = &flows;
+	src.handle = open_handle(trace_files[0]);
+	src.fp = trace_files[0];
+	src.files = trace_files;
+	src.start = filter.start;
+	src.end = filter.end;
+	src.offsets = NULL;
+	src.next_offset = 0;
+	src.index = NULL;
+	src.current = 0;
+	src.duplicates = filter.dedup_window != 0 ? &duplicates : NULL;
+
+	if (trace_files.size() > 1)
+	{
+		// Merge the files, starting with the first packet of each
+		src.inputs.resize(trace_files.size());
+		src.current = trace_files.size();
+
+		later_packet order;
+		order.inputs = &src.inputs;
+
+		for (unsigned i = 0; i < trace_files.size(); ++i)
+		{
+			input& in = src.inputs[i];
+			in.handle = i == 0 ? src.handle : open_handle(trace_files[i]);
+
+			if (pcap_datalink(in.handle) != pcap_datalink(src.handle))
+			{
+				throw std::runtime_error("Trace files have different link types");
+			}
+
+			set_filter(in.handle, (filter.str() + segment_filter).c_str());
+
+			if (next_record(in.handle, in.hdr, in.pkt))
+			{
+				src.pending.push_back(i);
+				std::push_heap(src.pending.begin(), src.pending.end(), order);
+			}
+		}
+	}
+	else if (index != NULL && filter.single_connection()
+			&& index->seek_connection(offsets, filter.src_addr, filter.src_port_start, filter.dst_addr, filter.dst_port_start))
+	{
+		// Only read the records of the connection, they already match the filter
+		src.offsets = &offsets;
+	}
+	else
+	{
+		// Scan the trace with the filter, also when the connection is not in
+		// the index, rather than silently reporting nothing
+		if (index != NULL && filter.start > 0)
+		{
+			// Start reading right before the time window
+			fseek(src.fp, index->seek_time(filter.start > ORDER_SLACK ? filter.start - ORDER_SLACK : 0), SEEK_SET);
+		}
+
+		set_filter(src.handle, (filter.str() + segment_filter).c_str());
 	}
 
-	filterstr = filter.str();
-	filterstr += " and tcp[tcpflags] & (tcp-syn|tcp-fin) = 0 and tcp[tcpflags] & (tcp-ack) != 0";
-	set_filter(handle, filterstr.c_str());
+	process_trace(src, level);
 
-	process_acks(handle);
+	return duplicates.dropped();
+}
+
+
+
+void stop_analysis()
+{
+	stopping = true;
+}
+
+
+
+void index_trace(flow_table& flows, FILE* fp, const filter& filter, tracking level, trace_index& index)
+{
+	source src;
+
+	if (ftell(fp) < 0)
+	{
+		throw std::runtime_error("Only uncompressed traces can be indexed");
+	}
+
+	src.flows = &flows;
+	src.handle = open_handle(fp);
+	src.fp = fp;
+	src.files.push_back(fp);
+	src.start = filter.start;
+	src.end = filter.end;
+	src.offsets = NULL;
+	src.next_offset = 0;
+	src.index = &index;
+	src.current = 0;
+	src.duplicates = NULL;
+
+	// Every packet that could be analyzed is indexed, not just the filtered ones
+	compile_filter(src.handle, src.indexed, string("tcp") + segment_filter);
+	compile_filter(src.handle, src.analyzed, filter.str() + segment_filter);
+
+	process_trace(src, level);
+
+	pcap_freecode(&src.indexed);
+	pcap_freecode(&src.analyzed);
+}
+
+
+
+/*
+ * Ingest the queued segments of a packet stream on the path of its tracking level.
+ */
+static void process_queued(flow_table& flows, tracking level, segment* batch, unsigned count)
+{
+	switch (level)
+	{
+		case TRACK_COUNTERS:
+			process_batch<track_counters>(flows, batch, count);
+			break;
+
+		case TRACK_RTT:
+			process_batch<track_rtt>(flows, batch, count);
+			break;
+
+		case TRACK_RANGES:
+			process_batch<track_ranges>(flows, batch, count);
+			break;
+	}
+}
+
+
+
+packet_stream::packet_stream(flow_table& flows, tracking level)
+	: flows(flows), level(level), batch(new segment[BATCH_SIZE]), count(0), duplicates(NULL)
+{
+}
+
+
+
+packet_stream::~packet_stream()
+{
+	delete[] batch;
+	delete duplicates;
+}
+
+
+
+void packet_stream::set_dedup_window(uint64_t window)
+{
+	delete duplicates;
+	duplicates = window != 0 ? new duplicate_filter(window) : NULL;
+}
+
+
+
+uint64_t packet_stream::dropped() const
+{
+	return duplicates != NULL ? duplicates->dropped() : 0;
+}
+
+
+
+void packet_stream::ignore(const flow& conn, const timeval& ts)
+{
+	flow key = conn.canonical();
+
+	closed[key] = USECS(ts);
+	closings.push_back(std::make_pair(USECS(ts), key));
+}
+
+
+
+bool packet_stream::push(const timeval& ts, const uint8_t* frame, uint32_t caplen, uint8_t& flags)
+{
+	const uint8_t* ip = frame + ETHERNET_FRAME_SIZE;
+
+	// Only unfragmented IPv4 packets carrying a complete TCP header are decoded
+	if (caplen < ETHERNET_FRAME_SIZE + 20
+			|| ip[-2] != 0x08 || ip[-1] != 0x00
+			|| (ip[0] >> 4) != 4 || ip[9] != IPPROTO_TCP
+			|| (ntohs(*((uint16_t*) (ip + 6))) & 0x1fff) != 0)
+	{
+		return false;
+	}
+
+	uint32_t tcp_off = (ip[0] & 0x0f) * 4;
+	if (caplen < ETHERNET_FRAME_SIZE + tcp_off + 20)
+	{
+		return false;
+	}
+
+	flags = ip[tcp_off + 13];
+
+	if (!closed.empty())
+	{
+		uint64_t now = USECS(ts);
+
+		// Forget connections that were closed longer than the linger time ago
+		while (!closings.empty() && closings.front().first + CLOSED_LINGER < now)
+		{
+			std::map<flow, uint64_t>::iterator it = closed.find(closings.front().second);
+			if (it != closed.end() && it->second == closings.front().first)
+			{
+				closed.erase(it);
+			}
+			closings.pop_front();
+		}
+
+		const uint8_t* tcp = ip + tcp_off;
+		flow conn(*((uint32_t*) (ip + 12)), *((uint16_t*) tcp), *((uint32_t*) (ip + 16)), *((uint16_t*) (tcp + 2)));
+		std::map<flow, uint64_t>::iterator it = closed.find(conn.canonical());
+
+		if (it != closed.end())
+		{
+			if (!(flags & TH_SYN))
+			{
+				return false;
+			}
+
+			// The endpoints are reused by a new connection
+			closed.erase(it);
+		}
+	}
+
+	// Copies of a teardown segment must not reach the teardown twice either
+	if (duplicates != NULL && duplicates->duplicate(ts, frame, caplen))
+	{
+		return false;
+	}
+
+	// Same selection as the trace filter: no connection setup or teardown, and an ACK
+	if ((flags & (TH_SYN | TH_FIN)) != 0 || (flags & TH_ACK) == 0)
+	{
+		return true;
+	}
+
+	pcap_pkthdr hdr;
+	hdr.ts = ts;
+	hdr.caplen = hdr.len = caplen;
+
+	switch (level)
+	{
+		case TRACK_COUNTERS:
+			decode<track_counters>(batch[count], &hdr, frame);
+			break;
+
+		case TRACK_RTT:
+			decode<track_rtt>(batch[count], &hdr, frame);
+			break;
+
+		case TRACK_RANGES:
+			decode<track_ranges>(batch[count], &hdr, frame);
+			break;
+	}
+
+	if (++count == BATCH_SIZE)
+	{
+		flush();
+	}
+
+	return true;
+}
+
+
+
+void packet_stream::flush()
+{
+	if (count > 0)
+	{
+		unsigned n = count;
+		count = 0;
+		process_queued(flows, level, batch, n);
+	}
+}
+
+
+
+filter::filter()
+	: src_addr(0), dst_addr(0)
+	, src_port_start(0), src_port_end(0)
+	, dst_port_start(0), dst_port_end(0)
+	, start(0), end(UINT64_MAX)
+	, dedup_window(0)
+{
+}
+
+
+
+bool filter::single_connection() const
+{
+	return src_addr != 0 && dst_addr != 0
+		&& src_port_start != 0 && src_port_start == src_port_end
+		&& dst_port_start != 0 && dst_port_start == dst_port_end;
+}
+
+
+
+bool filter::parse_connection(const char* conn)
+{
+	char src[16], dst[16];
+	unsigned sport, dport;
+	in_addr addr;
+
+	if (sscanf(conn, "%15[0-9.]:%u-%15[0-9.]:%u", src, &sport, dst, &dport) != 4
+			|| sport == 0 || sport > 0xffff || dport == 0 || dport > 0xffff)
+	{
+		return false;
+	}
+
+	if (inet_aton(src, &addr) == 0)
+		return false;
+	src_addr = addr.s_addr;
+
+	if (inet_aton(dst, &addr) == 0)
+		return false;
+	dst_addr = addr.s_addr;
+
+	src_port_start = src_port_end = htons(sport);
+	dst_port_start = dst_port_end = htons(dport);
+	return true;
+}
+
+
+
+/*
+ * Helper function to add a host and port range to a filter string
+ */
+static void add_endpoint(std::ostringstream& str, uint32_t addr, uint16_t port_start, uint16_t port_end)
+{
+	if (addr != 0)
+	{
+		in_addr in;
+		in.s_addr = addr;
+		str << " and host " << inet_ntoa(in);
+	}
+
+	if (port_start != 0)
+	{
+		str << " and portrange " << ntohs(port_start) << "-" << ntohs(port_end);
+	}
 }
 
 
 
 string filter::str() const
 {
-	string str("tcp");
+	std::ostringstream str;
+
+	str << "tcp";
+	add_endpoint(str, src_addr, src_port_start, src_port_end);
+	add_endpoint(str, dst_addr, dst_port_start, dst_port_end);
 
-	return str;
+	return str.str();
 }
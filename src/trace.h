@@ -4,6 +4,11 @@
 #include <cstdio>
 #include <tr1/cstdint>
 #include <string>
+#include <vector>
+#include <map>
+#include <deque>
+#include "index.h"
+#include "flow.h"
 
 
 
@@ -12,12 +17,26 @@
  */
 struct filter
 {
-	uint32_t src_addr;
+	uint32_t src_addr;			// 0 means any address
 	uint32_t dst_addr;
-	uint16_t src_port_start;
+	uint16_t src_port_start;	// 0 means any port
 	uint16_t src_port_end;
 	uint16_t dst_port_start;
 	uint16_t dst_port_end;
+	uint64_t start;				// start of time window (usecs)
+	uint64_t end;				// end of time window (usecs)
+	uint64_t dedup_window;		// drop copies of packets seen within this time (usecs, 0 keeps all)
+
+	filter();
+
+	/* Does the filter select a single connection */
+	bool single_connection() const;
+
+	/*
+	 * Select the connection given as ADDR:PORT-ADDR:PORT.
+	 * Returns false if the connection is invalid.
+	 */
+	bool parse_connection(const char* conn);
 
 	std::string str() const;
 };
@@ -25,8 +44,90 @@ struct filter
 
 
 /*
- * Analyze the streams.
+ * Analyze the streams, keeping the per-flow state of the given tracking level.
+ * Multiple trace files are merged by timestamp into a single stream, so they
+ * can be captures of the same connections at different points or rotated
+ * files of one capture.
+ * If an index of a single trace is given, it is used to seek directly to the
+ * packets of the filtered connection or time window.
+ * Returns the number of duplicate packets dropped.
+ */
+uint64_t analyze_trace(flow_table& flows, const std::vector<FILE*>& trace_files, const filter& processing_filter, tracking level, const trace_index* index = NULL);
+
+
+
+/*
+ * Analyze the streams and build an index of the trace at the same time.
+ * The trace must be a seekable (uncompressed) file.
  */
-void analyze_trace(FILE* trace_file, const filter& processing_filter);
+void index_trace(flow_table& flows, FILE* trace_file, const filter& processing_filter, tracking level, trace_index& index);
+
+
+
+/*
+ * Stop the ongoing analysis from another thread, as if the traces ended at
+ * the current packet. A read blocked on a quiet stream only returns once the
+ * analyzing thread is interrupted by a signal (with a handler that does not
+ * restart system calls).
+ */
+void stop_analysis();
+
+
+
+struct segment;
+class duplicate_filter;
+
+
+
+/*
+ * A stream of packets handed over one at a time, for example from a live
+ * capture or by an application embedding the analysis. Packets are decoded
+ * right away and ingested in batches, so the flows are only up to date once
+ * the stream is flushed.
+ */
+class packet_stream
+{
+	public:
+		packet_stream(flow_table& flows, tracking level);
+		~packet_stream();
+
+		/*
+		 * Decode a captured Ethernet frame and queue it if it is analyzed.
+		 * Returns false if the frame is not an IPv4 TCP segment, belongs to
+		 * an ignored connection or is a dropped copy, otherwise the TCP
+		 * flags of the segment are returned in flags.
+		 */
+		bool push(const timeval& timestamp, const uint8_t* frame, uint32_t caplen, uint8_t& flags);
+
+		/* Ingest all queued segments */
+		void flush();
+
+		/* Drop copies of packets seen within a time window (usecs, 0 keeps all) */
+		void set_dedup_window(uint64_t window);
+
+		/* Number of duplicate packets dropped */
+		uint64_t dropped() const;
+
+		/*
+		 * Ignore the segments of a closed connection for a linger time, so
+		 * its last ACKs and retransmitted FINs don't bring it back. A new
+		 * connection (SYN) on the same endpoints ends the linger right away.
+		 */
+		void ignore(const flow& conn, const timeval& timestamp);
+
+	private:
+		flow_table& flows;
+		tracking level;
+		segment* batch;			// queued segments
+		unsigned count;			// number of queued segments
+		duplicate_filter* duplicates;
+
+		std::map< flow, uint64_t > closed;					// time ignored connections were closed, by canonical flow
+		std::deque< std::pair<uint64_t, flow> > closings;	// (time, canonical flow), oldest first
+
+		/* Packet streams are not copyable */
+		packet_stream(const packet_stream& other);
+		packet_stream& operator=(const packet_stream& other);
+};
 
 #endif
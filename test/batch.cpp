@@ -0,0 +1,86 @@
+#include "test.h"
+#include "traces.h"
+#include <map>
+#include <string>
+#include <sstream>
+
+
+/*
+ * Packets are decoded, looked up and ingested in batches. Interleave enough
+ * connections that batches end in the middle of every one of them, and check
+ * that each flow still gets exactly its own segments.
+ */
+
+#define CLIENTS 50
+#define SEGMENTS 40
+#define LEN 1000
+
+
+
+static std::string id(uint32_t src, uint16_t sport, uint32_t dst, uint16_t dport)
+{
+	std::ostringstream s;
+	s << (src >> 24) << "." << ((src >> 16) & 255) << "." << ((src >> 8) & 255) << "." << (src & 255) << ":" << sport << "=>";
+	s << (dst >> 24) << "." << ((dst >> 16) & 255) << "." << ((dst >> 8) & 255) << "." << (dst & 255) << ":" << dport;
+	return s.str();
+}
+
+
+
+static void check_level(tracking level)
+{
+	std::vector<test_segment> segments;
+	uint32_t server = ADDR(10, 1, 0, 1);
+
+	for (unsigned c = 0; c < CLIENTS; ++c)
+	{
+		add_transfer(segments, 1000000 + c * 7, ADDR(10, 0, 0, c + 1), 20000 + c, server, SEGMENTS, LEN, 10000 + c * 100, c % 3 == 0 ? 1 + c % (SEGMENTS - 1) : SEGMENTS);
+	}
+
+	std::vector<FILE*> files(1, write_trace(segments));
+	std::vector<flowstats> stats;
+	analyze(stats, files, level);
+	fclose(files[0]);
+
+	CHECK(stats.size() == 2 * CLIENTS);
+
+	std::map<std::string, const flowstats*> by_id;
+	for (std::vector<flowstats>::const_iterator it = stats.begin(); it != stats.end(); ++it)
+	{
+		by_id[it->id] = &*it;
+	}
+
+	for (unsigned c = 0; c < CLIENTS; ++c)
+	{
+		uint32_t client = ADDR(10, 0, 0, c + 1);
+		const flowstats* sent = by_id[id(client, 20000 + c, server, 80)];
+		const flowstats* ackd = by_id[id(server, 80, client, 20000 + c)];
+
+		CHECK(sent != NULL && ackd != NULL);
+		if (sent == NULL || ackd == NULL)
+			continue;
+
+		bool lost = c % 3 == 0;
+		CHECK(sent->unique_bytes == SEGMENTS * LEN);
+		CHECK(sent->retrans == (lost ? 1u : 0u));
+		CHECK(sent->episodes[episode::FAST] == (lost ? 1u : 0u));
+		CHECK(ackd->unique_bytes == 0);
+		CHECK(ackd->dupacks == 0);
+
+		if (level == TRACK_RANGES)
+		{
+			CHECK(sent->dupacks == (lost ? 3u : 0u));
+			CHECK(sent->rtt == 10000 + c * 100 - 1);
+		}
+	}
+}
+
+
+
+int main()
+{
+	check_level(TRACK_COUNTERS);
+	check_level(TRACK_RANGES);
+
+	return test_status();
+}
@@ -0,0 +1,263 @@
+#include "test.h"
+#include "packets.h"
+#include "tcpstats.h"
+#include <stdlib.h>
+#include <arpa/inet.h>
+
+
+/*
+ * The library API is used from C. Check pushing savefile streams and single
+ * frames, reporting flows as their connections finish, and errors.
+ */
+
+#define MAX_SEGMENTS 256
+
+
+
+/* The flows reported to a callback */
+struct reported
+{
+	unsigned count;
+	uint64_t bytes;			// unique bytes of all reported flows
+	uint32_t retrans;
+	uint16_t ports[16];		// source port of each flow, in order (host byte order)
+};
+
+static void record(const struct tcpstats_flow* flow, void* arg)
+{
+	struct reported* r = (struct reported*) arg;
+
+	if (r->count < sizeof(r->ports) / sizeof(r->ports[0]))
+		r->ports[r->count] = ntohs(flow->src_port);
+	++r->count;
+	r->bytes += flow->unique_bytes;
+	r->retrans += flow->retrans;
+}
+
+
+
+/* A savefile of the segments, in memory */
+static size_t savefile(uint8_t* buf, size_t size, const struct test_segment* segments, unsigned count)
+{
+	FILE* fp = tmpfile();
+	size_t len;
+
+	write_pcap_header(fp);
+	for (unsigned i = 0; i < count; ++i)
+	{
+		write_segment(fp, &segments[i]);
+	}
+
+	rewind(fp);
+	len = fread(buf, 1, size, fp);
+	fclose(fp);
+	return len;
+}
+
+
+
+/* Push a savefile in chunks of the given size, so records are split */
+static int push_chunks(tcpstats_analyzer* a, const uint8_t* buf, size_t len, size_t chunk)
+{
+	for (size_t pos = 0; pos < len; pos += chunk)
+	{
+		if (tcpstats_push_buffer(a, buf + pos, pos + chunk < len ? chunk : len - pos) != 0)
+			return -1;
+	}
+	return 0;
+}
+
+
+
+/* A transfer of count segments of len bytes, each acknowledged */
+static unsigned add_transfer(struct test_segment* segments, uint64_t start, uint16_t port, unsigned count, uint16_t len)
+{
+	uint32_t client = ADDR(10, 0, 0, 1), server = ADDR(10, 1, 0, 1);
+	unsigned n = 0;
+
+	for (unsigned i = 0; i < count; ++i)
+	{
+		segments[n++] = make_segment(start + i * 1000, client, port, server, 80, 1000 + i * len, 5000, SEG_ACK, len);
+		segments[n++] = make_segment(start + i * 1000 + 500, server, 80, client, port, 5000, 1000 + (i + 1) * len, SEG_ACK, 0);
+	}
+	return n;
+}
+
+
+
+static void check_finished(size_t chunk)
+{
+	static struct test_segment segments[MAX_SEGMENTS];
+	static uint8_t buf[MAX_SEGMENTS * FRAME_MAX];
+	uint32_t client = ADDR(10, 0, 0, 1), server = ADDR(10, 1, 0, 1);
+	struct reported finished = { 0, 0, 0, { 0 } }, polled = { 0, 0, 0, { 0 } };
+	unsigned n = 0;
+
+	// Closed with FINs from both sides, the last ACK comes after the FINs
+	n += add_transfer(segments + n, 1000000, 30000, 10, 100);
+	segments[n++] = make_segment(1100000, client, 30000, server, 80, 2000, 5000, SEG_ACK | SEG_FIN, 0);
+	segments[n++] = make_segment(1100500, server, 80, client, 30000, 5000, 2001, SEG_ACK | SEG_FIN, 0);
+	segments[n++] = make_segment(1101000, client, 30000, server, 80, 2001, 5001, SEG_ACK, 0);
+
+	// Reset
+	n += add_transfer(segments + n, 1200000, 30001, 5, 100);
+	segments[n++] = make_segment(1300000, server, 80, client, 30001, 5000, 1500, SEG_RST, 0);
+
+	// Only the client has closed, so the connection stays open
+	n += add_transfer(segments + n, 1400000, 30002, 3, 100);
+	segments[n++] = make_segment(1500000, client, 30002, server, 80, 1300, 5000, SEG_ACK | SEG_FIN, 0);
+
+	size_t len = savefile(buf, sizeof(buf), segments, n);
+	tcpstats_analyzer* a = tcpstats_create(TCPSTATS_TRACK_RANGES);
+	tcpstats_on_finished(a, record, &finished);
+
+	CHECK(push_chunks(a, buf, len, chunk) == 0);
+	CHECK(finished.count == 4);
+	CHECK(finished.bytes == 10 * 100 + 5 * 100);
+
+	// Each connection is reported starting with the flow that closed it
+	CHECK(finished.ports[0] == 80 && finished.ports[1] == 30000 && finished.ports[2] == 80 && finished.ports[3] == 30001);
+
+	CHECK(tcpstats_poll(a, record, &polled) == 0);
+	CHECK(polled.count == 2 && polled.bytes == 3 * 100);
+	CHECK(tcpstats_flows(a) == 2);
+
+	CHECK(tcpstats_finish(a) == 0);
+	CHECK(finished.count == 6);
+	CHECK(tcpstats_flows(a) == 0);
+	tcpstats_destroy(a);
+}
+
+
+
+/* FINs of a connection that never got flows don't close a later one */
+static void check_stale_fins(void)
+{
+	struct test_segment segments[8];
+	uint8_t buf[8 * FRAME_MAX];
+	uint32_t client = ADDR(10, 0, 0, 1), server = ADDR(10, 1, 0, 1);
+	struct reported finished = { 0, 0, 0, { 0 } }, polled = { 0, 0, 0, { 0 } };
+	unsigned n = 0;
+
+	segments[n++] = make_segment(1000000, client, 1234, server, 80, 1000, 5000, SEG_ACK | SEG_FIN, 0);
+	segments[n++] = make_segment(1100000, server, 80, client, 1234, 5000, 1001, SEG_ACK | SEG_FIN, 0);
+
+	segments[n++] = make_segment(2000000, client, 1234, server, 80, 1100, 5100, SEG_SYN, 0);
+	segments[n++] = make_segment(2100000, client, 1234, server, 80, 1101, 5101, SEG_ACK | SEG_PSH, 1000);
+	segments[n++] = make_segment(2200000, server, 80, client, 1234, 5101, 2101, SEG_ACK, 0);
+	segments[n++] = make_segment(2300000, client, 1234, server, 80, 2101, 5101, SEG_ACK | SEG_FIN, 0);
+
+	size_t len = savefile(buf, sizeof(buf), segments, n);
+	tcpstats_analyzer* a = tcpstats_create(TCPSTATS_TRACK_COUNTERS);
+	tcpstats_on_finished(a, record, &finished);
+
+	CHECK(tcpstats_push_buffer(a, buf, len) == 0);
+	CHECK(finished.count == 0);
+	CHECK(tcpstats_poll(a, record, &polled) == 0);
+	CHECK(polled.count == 2);
+
+	CHECK(tcpstats_finish(a) == 0);
+	CHECK(finished.count == 2 && finished.bytes == 1000);
+	tcpstats_destroy(a);
+}
+
+
+
+/* Frames pushed one at a time, each twice as from a mirror port */
+static void check_packets(void)
+{
+	struct test_segment segments[32];
+	uint8_t frame[FRAME_MAX];
+	struct reported polled = { 0, 0, 0, { 0 } };
+	unsigned n = add_transfer(segments, 1000000, 40000, 16, 500);
+
+	tcpstats_analyzer* a = tcpstats_create(TCPSTATS_TRACK_COUNTERS);
+	CHECK(tcpstats_set_dedup_window(a, 1000) == 0);
+
+	for (unsigned i = 0; i < n; ++i)
+	{
+		struct timeval ts;
+		uint32_t len = build_frame(frame, &segments[i]);
+
+		ts.tv_sec = segments[i].time / 1000000;
+		ts.tv_usec = segments[i].time % 1000000;
+		CHECK(tcpstats_push_packet(a, &ts, frame, len) == 0);
+		CHECK(tcpstats_push_packet(a, &ts, frame, len) == 0);
+	}
+
+	// Not IPv4, ignored
+	frame[12] = 0x86;
+	frame[13] = 0xdd;
+	struct timeval ts = { 2, 0 };
+	CHECK(tcpstats_push_packet(a, &ts, frame, 100) == 0);
+
+	CHECK(tcpstats_duplicates(a) == n);
+	CHECK(tcpstats_poll(a, record, &polled) == 0);
+	CHECK(polled.count == 2);
+	CHECK(polled.bytes == 16 * 500);
+	CHECK(polled.retrans == 0);
+	tcpstats_destroy(a);
+}
+
+
+
+static void check_errors(void)
+{
+	uint8_t header[24];
+	FILE* fp = tmpfile();
+	write_pcap_header(fp);
+	rewind(fp);
+	CHECK(fread(header, 1, sizeof(header), fp) == sizeof(header));
+	fclose(fp);
+
+	tcpstats_analyzer* a = tcpstats_create(TCPSTATS_TRACK_RANGES);
+	CHECK(tcpstats_set_memory_limit(a, 1000) == -1);
+	CHECK(tcpstats_error(a)[0] != '\0');
+	CHECK(tcpstats_set_memory_limit(a, 1 << 20) == 0);
+	CHECK(tcpstats_set_memory_limit(a, 0) == 0);
+
+	// An incomplete header is kept until the rest arrives
+	CHECK(tcpstats_push_buffer(a, "\x01\x02", 2) == 0);
+	tcpstats_destroy(a);
+
+	a = tcpstats_create(TCPSTATS_TRACK_RANGES);
+	CHECK(tcpstats_push_buffer(a, "not a pcap savefile at all", 26) == -1);
+	CHECK(strstr(tcpstats_error(a), "pcap") != NULL);
+	tcpstats_destroy(a);
+
+	header[20] = 113;	// Linux cooked capture
+	a = tcpstats_create(TCPSTATS_TRACK_RANGES);
+	CHECK(tcpstats_push_buffer(a, header, sizeof(header)) == -1);
+	CHECK(strstr(tcpstats_error(a), "Ethernet") != NULL);
+	tcpstats_destroy(a);
+
+	// Destroying an analyzer with open connections doesn't report them
+	struct test_segment segments[4];
+	uint8_t buf[4 * FRAME_MAX];
+	struct reported finished = { 0, 0, 0, { 0 } };
+	size_t len = savefile(buf, sizeof(buf), segments, add_transfer(segments, 1000000, 50000, 2, 100));
+
+	a = tcpstats_create(TCPSTATS_TRACK_RTT);
+	tcpstats_on_finished(a, record, &finished);
+	CHECK(tcpstats_push_buffer(a, buf, len) == 0);
+	tcpstats_destroy(a);
+	CHECK(finished.count == 0);
+}
+
+
+
+int main(void)
+{
+	size_t chunks[] = { 1, 7, 24, 100, 4096, 1 << 20 };
+
+	for (unsigned i = 0; i < sizeof(chunks) / sizeof(chunks[0]); ++i)
+	{
+		check_finished(chunks[i]);
+	}
+
+	check_stale_fins();
+	check_packets();
+	check_errors();
+
+	return test_status();
+}
@@ -0,0 +1,143 @@
+#include "test.h"
+#include "traces.h"
+#include <arpa/inet.h>
+
+
+/*
+ * Adjacent byte ranges are coalesced once they are settled with the same
+ * counts, so the range history of a long transfer stays small. Check that
+ * coalescing keeps the statistics computed from the ranges exact.
+ */
+
+#define SEGMENTS 1000
+#define LEN 1000
+
+
+
+static const flowdata* find_sender(const flow_table& flows)
+{
+	flow_table::iterator it = flows.find(flow(htonl(ADDR(10, 0, 0, 1)), htons(30000), htonl(ADDR(10, 1, 0, 1)), htons(80)));
+	CHECK(it != flows.end());
+	return it != flows.end() ? &it.data() : NULL;
+}
+
+
+
+/*
+ * An in-order transfer, with RTTs varying from 1000 to 1499 usecs and an ACK
+ * for every second segment after the first stride segments
+ */
+static void add_transfer(std::vector<test_segment>& segments, unsigned stride, unsigned lost)
+{
+	uint32_t client = ADDR(10, 0, 0, 1), server = ADDR(10, 1, 0, 1);
+	uint32_t seq = 1000, ack = 5000;
+
+	for (unsigned i = 0; i < SEGMENTS; ++i, seq += LEN)
+	{
+		uint64_t t = 1000000 + i * 2000;
+		segments.push_back(make_segment(t, client, 30000, server, 80, seq, ack, SEG_ACK, LEN));
+
+		if (i == lost)
+		{
+			for (unsigned d = 0; d < 3; ++d)
+				segments.push_back(make_segment(t + 100 + d, server, 80, client, 30000, ack, seq, SEG_ACK, 0));
+			segments.push_back(make_segment(t + 200, client, 30000, server, 80, seq, ack, SEG_ACK, LEN));
+		}
+
+		if (i < stride || i % 2 == 1)
+			segments.push_back(make_segment(t + 1000 + (i * 37) % 500, server, 80, client, 30000, ack, seq + LEN, SEG_ACK, 0));
+	}
+}
+
+
+
+static void check_in_order()
+{
+	std::vector<test_segment> segments;
+	add_transfer(segments, SEGMENTS, UINT32_MAX);
+
+	std::vector<FILE*> files(1, write_trace(segments));
+	flow_table flows;
+	analyze(flows, files, TRACK_RANGES);
+	fclose(files[0]);
+
+	const flowdata* data = find_sender(flows);
+	if (data == NULL)
+		return;
+
+	CHECK(data->range_count() == 1);
+	CHECK(data->unique_bytes_sent() == SEGMENTS * LEN);
+	CHECK(data->total_retrans() == 0);
+	CHECK(data->total_dupacks() == 0);
+	CHECK(data->rtt() == 1000);
+}
+
+
+
+static void check_delayed_acks()
+{
+	std::vector<test_segment> segments;
+	add_transfer(segments, 0, UINT32_MAX);
+
+	std::vector<FILE*> files(1, write_trace(segments));
+	flow_table flows;
+	analyze(flows, files, TRACK_RANGES);
+	fclose(files[0]);
+
+	const flowdata* data = find_sender(flows);
+	if (data == NULL)
+		return;
+
+	// Each ACK covers two segments, the later one gives the lowest RTT
+	uint64_t rtt = UINT64_MAX;
+	for (unsigned i = 1; i < SEGMENTS; i += 2)
+	{
+		rtt = std::min<uint64_t>(rtt, 1000 + (i * 37) % 500);
+	}
+
+	CHECK(data->range_count() == 1);
+	CHECK(data->unique_bytes_sent() == SEGMENTS * LEN);
+	CHECK(data->total_dupacks() == 0);
+	CHECK(data->rtt() == rtt);
+}
+
+
+
+static void check_loss()
+{
+	std::vector<test_segment> segments;
+	add_transfer(segments, SEGMENTS, SEGMENTS / 2);
+
+	// A spurious retransmission of data acknowledged long ago
+	segments.push_back(make_segment(5000000, ADDR(10, 0, 0, 1), 30000, ADDR(10, 1, 0, 1), 80, 1000 + 100 * LEN + LEN / 2, 5000, SEG_ACK, LEN));
+
+	std::vector<FILE*> files(1, write_trace(segments));
+	flow_table flows;
+	analyze(flows, files, TRACK_RANGES);
+	fclose(files[0]);
+
+	const flowdata* data = find_sender(flows);
+	if (data == NULL)
+		return;
+
+	// Only the ranges around the lost segment and the spurious retransmission stay apart
+	CHECK(data->range_count() <= 6);
+	CHECK(data->unique_bytes_sent() == SEGMENTS * LEN);
+	CHECK(data->total_retrans() == 2);
+	CHECK(data->max_num_retrans() == 1);
+	CHECK(data->total_dupacks() == 3);
+	CHECK(data->total_retrans() == data->retrans_count());
+	CHECK(data->total_dupacks() == data->dupack_count());
+	CHECK(data->rtt() == 1000);
+}
+
+
+
+int main()
+{
+	check_in_order();
+	check_delayed_acks();
+	check_loss();
+
+	return test_status();
+}
@@ -0,0 +1,133 @@
+#include "test.h"
+#include "traces.h"
+#include <arpa/inet.h>
+
+
+/*
+ * Both flows of a connection share a single entry, keyed by the canonical
+ * (lower) flow. Check lookups from either direction, and that the flow of
+ * a direction that sent nothing is never counted, listed or reported.
+ */
+
+#define CLIENTS 40
+
+
+
+static flow client_flow(unsigned c)
+{
+	return flow(htonl(ADDR(10, 0, 0, c + 1)), htons(30000 + c), htonl(ADDR(10, 1, 0, 1)), htons(80));
+}
+
+
+
+static void check_lookup()
+{
+	flow_table flows;
+	const flow* sent_conn;
+	const flow* ackd_conn;
+	flowdata* sent;
+	flowdata* ackd;
+	flow conn = client_flow(0);
+
+	CHECK(flows.find_connection(sent_conn, sent, ackd_conn, ackd, conn.src_addr(), conn.src_port(), conn.dst_addr(), conn.dst_port()));
+	CHECK(sent_conn->id() == conn.id() && ackd_conn->id() == conn.reverse().id());
+	CHECK(sent != ackd);
+
+	// The opposite direction finds the same entry, with the roles swapped
+	const flow* rev_sent_conn;
+	const flow* rev_ackd_conn;
+	flowdata* rev_sent;
+	flowdata* rev_ackd;
+	flows.find_connection(rev_sent_conn, rev_sent, rev_ackd_conn, rev_ackd, conn.dst_addr(), conn.dst_port(), conn.src_addr(), conn.src_port());
+	CHECK(rev_sent == ackd && rev_ackd == sent);
+	CHECK(rev_sent_conn == ackd_conn && rev_ackd_conn == sent_conn);
+
+	// Nothing was sent yet
+	CHECK(flows.count() == 0);
+	CHECK(flows.begin() == flows.end());
+	CHECK(flows.find(conn) == flows.end());
+
+	flows.erase(conn.reverse());
+	flows.find_connection(rev_sent_conn, rev_sent, rev_ackd_conn, rev_ackd, conn.src_addr(), conn.src_port(), conn.dst_addr(), conn.dst_port());
+	CHECK(rev_sent->highest_seqno() == 0);
+}
+
+
+
+static void check_trace()
+{
+	std::vector<test_segment> segments;
+	unsigned one_way = 0;
+
+	for (unsigned c = 0; c < CLIENTS; ++c)
+	{
+		flow conn = client_flow(c);
+		uint32_t client = ntohl(conn.src_addr()), server = ntohl(conn.dst_addr());
+
+		if (c % 3 == 0)
+		{
+			// Captured in one direction only, no ACKs are seen
+			for (unsigned i = 0; i < 5; ++i)
+				segments.push_back(make_segment(1000000 + c * 1000 + i * 100, client, 30000 + c, server, 80, 1000 + i * 100, 5000, SEG_ACK, 100));
+			++one_way;
+		}
+		else
+		{
+			add_transfer(segments, 1000000 + c * 1000, client, 30000 + c, server, 5, 100, 500, UINT32_MAX);
+		}
+	}
+
+	std::vector<FILE*> files(1, write_trace(segments));
+	flow_table flows;
+	analyze(flows, files, TRACK_RANGES);
+	rewind(files[0]);
+	std::vector<flowstats> stats;
+	analyze(stats, files, TRACK_RANGES);
+	fclose(files[0]);
+
+	unsigned expected = 2 * CLIENTS - one_way;
+	CHECK(flows.count() == expected);
+	CHECK(stats.size() == expected);
+
+	// Flows are listed by connection, the canonical flow first
+	unsigned listed = 0;
+	for (flow_table::iterator it = flows.begin(); it != flows.end(); ++it, ++listed)
+	{
+		const flow& conn = it.conn();
+		flow_table::iterator rev = flows.find(conn.reverse());
+
+		CHECK(it.data().seen());
+		CHECK(flows.find(conn) == it);
+		if (rev != flows.end())
+		{
+			CHECK(conn < conn.reverse());
+			++it;
+			++listed;
+			CHECK(it == rev);
+		}
+	}
+	CHECK(listed == expected);
+
+	for (unsigned c = 0; c < CLIENTS; ++c)
+	{
+		flow conn = client_flow(c);
+		CHECK(flows.find(conn) != flows.end());
+		CHECK((flows.find(conn.reverse()) == flows.end()) == (c % 3 == 0));
+	}
+
+	// Erasing a connection from either direction removes both flows
+	flows.erase(client_flow(1).reverse());
+	flows.erase(client_flow(3));
+	CHECK(flows.count() == expected - 3);
+	CHECK(flows.find(client_flow(1)) == flows.end());
+}
+
+
+
+int main()
+{
+	check_lookup();
+	check_trace();
+
+	return test_status();
+}
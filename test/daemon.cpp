@@ -0,0 +1,230 @@
+#include "test.h"
+#include "traces.h"
+#include "registry.h"
+#include "daemon.h"
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <arpa/inet.h>
+
+using std::string;
+
+
+/*
+ * Flow summaries are published to a registry while a trace is analyzed, and
+ * served over a query socket. Check the summaries, reading them while they
+ * are written, and the answers to every kind of query.
+ */
+
+#define CLIENTS 2500
+#define SEGMENTS 3
+#define LEN 100
+
+static char dir[] = "/tmp/tcpstats-test-XXXXXX";
+
+
+
+/* A reader walking the registry while it is written */
+struct reader
+{
+	const registry* summaries;
+	volatile bool done;
+	unsigned reads;
+	unsigned inconsistent;
+};
+
+
+
+static void* read_registry(void* arg)
+{
+	reader* r = (reader*) arg;
+	std::vector<uint64_t> bytes;
+
+	while (!r->done)
+	{
+		uint32_t count = r->summaries->count();
+		bytes.resize(count, 0);
+
+		for (uint32_t i = 0; i < count; ++i)
+		{
+			flow_summary s;
+			r->summaries->read(i, s);
+			++r->reads;
+
+			// A torn copy would mix up fields of different updates
+			bool client = ntohs(s.src_port) != 80;
+			if (s.first > s.last || s.bytes < bytes[i] || (client ? s.bytes > SEGMENTS * LEN : s.bytes != 0)
+					|| ntohs(client ? s.dst_port : s.src_port) != 80 || s.retrans != 0)
+			{
+				++r->inconsistent;
+			}
+			bytes[i] = s.bytes;
+		}
+	}
+
+	return NULL;
+}
+
+
+
+static void check_registry(const std::vector<test_segment>& segments, registry& summaries)
+{
+	std::vector<FILE*> files(1, write_trace(segments));
+	flow_table flows;
+	flows.publish(&summaries);
+
+	reader r;
+	r.summaries = &summaries;
+	r.done = false;
+	r.reads = 0;
+	r.inconsistent = 0;
+	pthread_t thread;
+	pthread_create(&thread, NULL, read_registry, &r);
+
+	analyze(flows, files, TRACK_RTT);
+	fclose(files[0]);
+
+	r.done = true;
+	pthread_join(thread, NULL);
+	CHECK(r.inconsistent == 0);
+
+	// Every flow that sent anything is published, with its latest statistics
+	CHECK(summaries.count() == flows.count());
+	CHECK(summaries.count() == 2 * CLIENTS);
+
+	for (flow_table::iterator it = flows.begin(); it != flows.end(); ++it)
+	{
+		flow_summary s;
+		CHECK(summaries.find(it.conn(), s));
+		CHECK(s.src_addr == it.conn().src_addr() && s.src_port == it.conn().src_port());
+		CHECK(s.bytes == it.data().highest_seqno());
+		CHECK(s.dupacks == it.data().dupack_count());
+		CHECK(s.last - s.first == it.data().duration());
+	}
+
+	flow_summary s;
+	CHECK(!summaries.find(flow(htonl(ADDR(10, 9, 9, 9)), htons(1), htonl(ADDR(10, 1, 0, 1)), htons(80)), s));
+}
+
+
+
+/* Send queries and read until the responses to all of them have ended */
+static string query(const string& path, const string& queries, unsigned responses)
+{
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path.c_str());
+
+	string out;
+	if (connect(fd, (sockaddr*) &addr, sizeof(addr)) != 0 || write(fd, queries.data(), queries.size()) != (ssize_t) queries.size())
+	{
+		close(fd);
+		return out;
+	}
+
+	// Each response ends with an empty line
+	char buf[65536];
+	ssize_t n;
+	unsigned ended = 0;
+	while (ended < responses && (n = read(fd, buf, sizeof(buf))) > 0)
+	{
+		for (ssize_t i = 0; i < n; ++i)
+		{
+			if (buf[i] == '\n' && !out.empty() && out[out.size() - 1] == '\n')
+				++ended;
+			out += buf[i];
+		}
+	}
+
+	close(fd);
+	return out;
+}
+
+
+
+static unsigned lines(const string& out)
+{
+	unsigned count = 0;
+	for (size_t pos = out.find('\n'); pos != string::npos; pos = out.find('\n', pos + 1))
+	{
+		if (pos > 0 && out[pos - 1] != '\n')
+			++count;
+	}
+	return count;
+}
+
+
+
+static void check_server(const registry& summaries)
+{
+	string path = string(dir) + "/query.sock";
+	query_server* server = start_query_server(path.c_str(), summaries);
+
+	string out = query(path, "flow 10.0.0.1:30000-10.1.0.1:80\n", 1);
+	CHECK(lines(out) == 2);
+	CHECK(out.find("10.0.0.1:30000=>10.1.0.1:80 bytes=300 ") != string::npos);
+	CHECK(out.find("10.1.0.1:80=>10.0.0.1:30000 bytes=0 ") != string::npos);
+
+	// Clients with more bytes come first
+	out = query(path, "top 3\n", 1);
+	CHECK(lines(out) == 3);
+	CHECK(out.find("bytes=0 ") == string::npos);
+
+	out = query(path, "snapshot\n", 1);
+	CHECK(lines(out) == 2 * CLIENTS);
+
+	// Several queries at once, one with a Windows line end
+	out = query(path, "flow 10.0.0.9:1-10.1.0.1:80\ntop 0\nflow nowhere\nbogus\r\ntop 1\n", 5);
+	CHECK(out == "\nerror: invalid count\n\nerror: invalid connection\n\nerror: unknown query\n\n" + query(path, "top 1\n", 1));
+
+	stop_query_server(server);
+	CHECK(access(path.c_str(), F_OK) != 0);
+
+	// A socket path that doesn't fit is rejected
+	bool rejected = false;
+	try
+	{
+		start_query_server((string(dir) + "/" + string(200, 'x')).c_str(), summaries);
+	}
+	catch (std::runtime_error&)
+	{
+		rejected = true;
+	}
+	CHECK(rejected);
+}
+
+
+
+int main()
+{
+	if (mkdtemp(dir) == NULL)
+	{
+		perror("mkdtemp");
+		return 1;
+	}
+
+	// Enough flows to fill more than one chunk of the registry
+	std::vector<test_segment> segments;
+	for (unsigned c = 0; c < CLIENTS; ++c)
+	{
+		add_transfer(segments, 1000000 + c * 100, ADDR(10, 0, c / 250, c % 250 + 1), 30000 + c, ADDR(10, 1, 0, 1), SEGMENTS, LEN, 20000, UINT32_MAX);
+	}
+
+	registry summaries;
+	check_registry(segments, summaries);
+	check_server(summaries);
+
+	string cleanup = string("rm -rf ") + dir;
+	if (system(cleanup.c_str()) != 0)
+	{
+		perror(cleanup.c_str());
+	}
+
+	return test_status();
+}
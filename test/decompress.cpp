@@ -0,0 +1,234 @@
+#include "test.h"
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <stdexcept>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <zlib.h>
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+#include "decompress.h"
+
+using std::string;
+
+
+/*
+ * Traces are decompressed on a separate thread while they are read. Check
+ * that every format reads back exactly the bytes written, including
+ * concatenated members and padding, and that truncated input is an error.
+ */
+
+static char dir[] = "/tmp/tcpstats-test-XXXXXX";
+
+
+
+/* Data that compresses, but not to nothing, and is larger than a block */
+static string payload(size_t len)
+{
+	string data(len, 0);
+	uint32_t x = 12345;
+
+	for (size_t i = 0; i < len; ++i)
+	{
+		x = x * 1103515245 + 12345;
+		data[i] = "pcap tcp trace "[(x >> 16) % 15];
+	}
+	return data;
+}
+
+
+
+static string gzip(const string& data)
+{
+	z_stream zs;
+	memset(&zs, 0, sizeof(zs));
+	if (deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+	{
+		throw std::runtime_error("deflateInit2 failed");
+	}
+
+	string out(deflateBound(&zs, data.size()), 0);
+	zs.next_in = (Bytef*) data.data();
+	zs.avail_in = data.size();
+	zs.next_out = (Bytef*) &out[0];
+	zs.avail_out = out.size();
+	deflate(&zs, Z_FINISH);
+	out.resize(zs.total_out);
+	deflateEnd(&zs);
+	return out;
+}
+
+
+
+#ifdef HAVE_ZSTD
+static string zstd(const string& data)
+{
+	string out(ZSTD_compressBound(data.size()), 0);
+	out.resize(ZSTD_compress(&out[0], out.size(), data.data(), data.size(), 3));
+	return out;
+}
+#endif
+
+
+
+static string write_file(const char* name, const string& contents)
+{
+	string path = string(dir) + "/" + name;
+	FILE* fp = fopen(path.c_str(), "w");
+	fwrite(contents.data(), 1, contents.size(), fp);
+	fclose(fp);
+	return path;
+}
+
+
+
+/* Read a trace through open_trace(), returns whether it read without error */
+static bool read_trace(const string& path, string& data)
+{
+	FILE* fp = open_trace(path.c_str());
+	char buf[10000];
+	size_t n;
+
+	data.clear();
+	while ((n = fread(buf, 1, sizeof(buf), fp)) > 0)
+	{
+		data.append(buf, n);
+	}
+
+	bool ok = !ferror(fp);
+	fclose(fp);
+	return ok;
+}
+
+
+
+static void check_reads(const char* name, const string& contents, const string& expected)
+{
+	string data;
+	CHECK(read_trace(write_file(name, contents), data));
+	CHECK(data == expected);
+}
+
+
+
+static void check_truncated(const char* name, const string& contents, const string& expected)
+{
+	string data;
+	CHECK(!read_trace(write_file(name, contents.substr(0, contents.size() / 2)), data));
+	CHECK(data.size() < expected.size());
+	CHECK(data == expected.substr(0, data.size()));
+}
+
+
+
+struct pipe_writer
+{
+	string path;
+	string contents;
+};
+
+
+
+static void* write_pipe(void* arg)
+{
+	pipe_writer* w = (pipe_writer*) arg;
+	FILE* fp = fopen(w->path.c_str(), "w");
+
+	// Small writes, so the reader waits for data
+	for (size_t pos = 0; pos < w->contents.size(); pos += 1000)
+	{
+		fwrite(w->contents.data() + pos, 1, std::min<size_t>(1000, w->contents.size() - pos), fp);
+		fflush(fp);
+	}
+	fclose(fp);
+	return NULL;
+}
+
+
+
+/* A pipe can't be rewound, the peeked magic number is replayed */
+static void check_pipe(const string& contents, const string& expected)
+{
+	pipe_writer w;
+	w.path = string(dir) + "/pipe";
+	w.contents = contents;
+	CHECK(mkfifo(w.path.c_str(), 0600) == 0);
+
+	pthread_t writer;
+	pthread_create(&writer, NULL, write_pipe, &w);
+
+	string data;
+	CHECK(read_trace(w.path, data));
+	CHECK(data == expected);
+
+	pthread_join(writer, NULL);
+	unlink(w.path.c_str());
+}
+
+
+
+int main()
+{
+	if (mkdtemp(dir) == NULL)
+	{
+		perror("mkdtemp");
+		return 1;
+	}
+
+	string data = payload(3 << 20);
+	string half = data.substr(0, data.size() / 2), rest = data.substr(data.size() / 2);
+
+	check_reads("plain", data, data);
+	check_reads("short", "ab", "ab");
+	check_reads("empty", "", "");
+
+	check_reads("gz", gzip(data), data);
+	check_reads("members.gz", gzip(half) + gzip(rest), data);
+	check_reads("padded.gz", gzip(data) + string(4096, 0), data);
+	check_reads("trailing.gz", gzip(data) + "trailing garbage", data);
+	check_truncated("truncated.gz", gzip(data), data);
+	check_pipe(gzip(half) + gzip(rest), data);
+	check_pipe(data, data);
+
+#ifdef HAVE_ZSTD
+	check_reads("zst", zstd(data), data);
+	check_reads("frames.zst", zstd(half) + zstd(rest), data);
+	check_truncated("truncated.zst", zstd(data), data);
+	check_pipe(zstd(data), data);
+#else
+	bool rejected = false;
+	try
+	{
+		string read;
+		read_trace(write_file("zst", string("\x28\xb5\x2f\xfd", 4) + data), read);
+	}
+	catch (std::runtime_error&)
+	{
+		rejected = true;
+	}
+	CHECK(rejected);
+#endif
+
+	bool missing = false;
+	try
+	{
+		open_trace((string(dir) + "/missing").c_str());
+	}
+	catch (std::runtime_error&)
+	{
+		missing = true;
+	}
+	CHECK(missing);
+
+	string cleanup = string("rm -rf ") + dir;
+	if (system(cleanup.c_str()) != 0)
+	{
+		perror(cleanup.c_str());
+	}
+
+	return test_status();
+}
@@ -0,0 +1,137 @@
+#include "test.h"
+#include "traces.h"
+#include "dedup.h"
+
+
+/*
+ * Copies of packets, as delivered by a mirror port, are dropped within a time
+ * window. Check that only true copies are dropped, and that a trace of
+ * mirrored packets gives the same statistics as the original trace.
+ */
+
+#define CLIENTS 10
+
+
+
+static bool duplicate(duplicate_filter& filter, const test_segment& s)
+{
+	uint8_t frame[FRAME_MAX];
+	uint32_t len = build_frame(frame, &s);
+	timeval ts;
+
+	ts.tv_sec = s.time / 1000000;
+	ts.tv_usec = s.time % 1000000;
+	return filter.duplicate(ts, frame, len);
+}
+
+
+
+static test_segment at(const test_segment& s, uint64_t time)
+{
+	test_segment copy = s;
+	copy.time = time;
+	return copy;
+}
+
+
+
+static void check_filter()
+{
+	duplicate_filter filter(1000);
+	uint32_t client = ADDR(10, 0, 0, 1), server = ADDR(10, 1, 0, 1);
+
+	test_segment data = make_segment(1000000, client, 30000, server, 80, 1000, 5000, SEG_ACK, 100);
+	CHECK(!duplicate(filter, data));
+	CHECK(duplicate(filter, at(data, 1000010)));
+	CHECK(duplicate(filter, at(data, 1001000)));
+
+	// A retransmission has a new IP ID
+	test_segment retrans = make_segment(1000500, client, 30000, server, 80, 1000, 5000, SEG_ACK, 100);
+	CHECK(!duplicate(filter, retrans));
+
+	// Packets are forgotten once they fall out of the window
+	CHECK(!duplicate(filter, at(data, 1001001)));
+	CHECK(duplicate(filter, at(data, 1001002)));
+	CHECK(filter.dropped() == 3);
+
+	// Without an IP ID or a timestamp option, copies can't be told from retransmissions
+	test_segment no_id = make_segment(1002000, client, 30000, server, 80, 1100, 5000, SEG_ACK, 100);
+	no_id.ip_id = 0;
+	CHECK(!duplicate(filter, no_id));
+	CHECK(!duplicate(filter, at(no_id, 1002001)));
+
+	// With a timestamp option they can, duplicate ACKs carry new timestamps
+	test_segment ack = make_segment(1003000, server, 80, client, 30000, 5000, 1100, SEG_ACK, 0);
+	ack.ip_id = 0;
+	ack.has_ts = 1;
+	ack.tsval = 77;
+	CHECK(!duplicate(filter, ack));
+	CHECK(duplicate(filter, at(ack, 1003001)));
+	ack.tsval = 78;
+	CHECK(!duplicate(filter, at(ack, 1003100)));
+
+	// Truncated captures are kept
+	uint8_t frame[FRAME_MAX];
+	uint32_t len = build_frame(frame, &data);
+	timeval ts = { 2, 0 };
+	CHECK(!filter.duplicate(ts, frame, ETHERNET_FRAME_SIZE + 20 + 10));
+	CHECK(!filter.duplicate(ts, frame, ETHERNET_FRAME_SIZE + 20 + 10));
+	CHECK(!filter.duplicate(ts, frame, len));
+	CHECK(duplicate(filter, at(data, 2000000)));
+
+	CHECK(filter.dropped() == 5);
+}
+
+
+
+static void check_trace()
+{
+	std::vector<test_segment> segments, mirrored;
+	for (unsigned c = 0; c < CLIENTS; ++c)
+	{
+		add_transfer(segments, 1000000 + c * 1000, ADDR(10, 0, 0, c + 1), 30000 + c, ADDR(10, 1, 0, 1), 30, 1000, 20000, c % 2 == 0 ? c + 1 : UINT32_MAX);
+	}
+
+	// Every packet is delivered twice, the copy shortly after
+	for (std::vector<test_segment>::const_iterator it = segments.begin(); it != segments.end(); ++it)
+	{
+		mirrored.push_back(*it);
+		mirrored.push_back(at(*it, it->time + 3));
+	}
+
+	std::vector<FILE*> files(1, write_trace(segments));
+	std::vector<flowstats> original, deduplicated;
+	analyze(original, files, TRACK_RANGES);
+	fclose(files[0]);
+
+	files[0] = write_trace(mirrored);
+	flow_table flows;
+	filter f;
+	f.dedup_window = 1000;
+	CHECK(analyze_trace(flows, files, f, TRACK_RANGES) == segments.size());
+	fclose(files[0]);
+	finalize_stats(flows, deduplicated, TRACK_RANGES, 2);
+
+	CHECK(deduplicated.size() == original.size());
+	for (size_t i = 0; i < deduplicated.size() && i < original.size(); ++i)
+	{
+		CHECK(same_stats(deduplicated[i], original[i]));
+	}
+
+	// Without deduplication, every copy is a retransmission or duplicate ACK
+	std::vector<flowstats> copies;
+	files[0] = write_trace(mirrored);
+	analyze(copies, files, TRACK_RANGES);
+	fclose(files[0]);
+	CHECK(copies.size() == original.size() && copies[0].retrans > original[0].retrans);
+}
+
+
+
+int main()
+{
+	check_filter();
+	check_trace();
+
+	return test_status();
+}
@@ -0,0 +1,111 @@
+#include "test.h"
+#include <arpa/inet.h>
+#include "traces.h"
+
+
+/*
+ * Retransmissions are classified into episodes as they happen, and only the
+ * most recent EPISODE_HISTORY episodes are kept per flow. Check the
+ * classification, and that the totals still count every episode.
+ */
+
+#define CYCLES 40
+#define LEN 100
+
+
+
+/*
+ * Every cycle has a fast retransmit, a timeout and a spurious retransmission,
+ * each of one segment of LEN bytes
+ */
+static void add_cycles(std::vector<test_segment>& segments, uint32_t client, uint32_t server)
+{
+	uint32_t seq = 1000, ack = 5000;
+
+	// A first segment, so there is an ACK for the duplicates to repeat
+	segments.push_back(make_segment(0, client, 40000, server, 80, seq, ack, SEG_ACK, LEN));
+	segments.push_back(make_segment(1000, server, 80, client, 40000, ack, seq + LEN, SEG_ACK, 0));
+	seq += LEN;
+
+
+	for (unsigned k = 0; k < CYCLES; ++k, seq += 2 * LEN)
+	{
+		uint64_t t = 1000000 + k * 100000;
+
+		// Lost, signalled with duplicate ACKs and retransmitted
+		segments.push_back(make_segment(t, client, 40000, server, 80, seq, ack, SEG_ACK, LEN));
+		for (unsigned d = 0; d < 3; ++d)
+			segments.push_back(make_segment(t + 1000 + d, server, 80, client, 40000, ack, seq, SEG_ACK, 0));
+		segments.push_back(make_segment(t + 2000, client, 40000, server, 80, seq, ack, SEG_ACK, LEN));
+		segments.push_back(make_segment(t + 3000, server, 80, client, 40000, ack, seq + LEN, SEG_ACK, 0));
+
+		// Lost and retransmitted without any signal from the receiver
+		segments.push_back(make_segment(t + 4000, client, 40000, server, 80, seq + LEN, ack, SEG_ACK, LEN));
+		segments.push_back(make_segment(t + 50000, client, 40000, server, 80, seq + LEN, ack, SEG_ACK, LEN));
+		segments.push_back(make_segment(t + 51000, server, 80, client, 40000, ack, seq + 2 * LEN, SEG_ACK, 0));
+
+		// Retransmitted although it was acknowledged
+		segments.push_back(make_segment(t + 60000, client, 40000, server, 80, seq + LEN, ack, SEG_ACK, LEN));
+	}
+}
+
+
+
+static void check_level(tracking level)
+{
+	std::vector<test_segment> segments;
+	uint32_t client = ADDR(10, 0, 0, 1), server = ADDR(10, 0, 0, 2);
+	add_cycles(segments, client, server);
+
+	std::vector<FILE*> files(1, write_trace(segments));
+	flow_table flows;
+	analyze(flows, files, level);
+	rewind(files[0]);
+	std::vector<flowstats> stats;
+	analyze(stats, files, level);
+	fclose(files[0]);
+
+	flow_table::iterator it = flows.find(flow(htonl(client), htons(40000), htonl(server), htons(80)));
+	CHECK(it != flows.end());
+	if (it == flows.end())
+		return;
+
+	const flowdata& data = it.data();
+	CHECK(data.retrans_count() == 3 * CYCLES);
+	CHECK(data.episodes().size() == EPISODE_HISTORY);
+	CHECK(data.episodes().back().type == episode::SPURIOUS);
+	CHECK(data.episodes().back().bytes == LEN);
+
+	for (unsigned type = episode::FAST; type <= episode::SPURIOUS; ++type)
+	{
+		CHECK(data.num_episodes((episode::kind) type) == CYCLES);
+		CHECK(data.episode_bytes((episode::kind) type) == CYCLES * LEN);
+	}
+
+	// The fast retransmit ends when the retransmitted segment is acknowledged
+	const episode& fast = data.episodes()[data.episodes().size() - 3];
+	CHECK(fast.type == episode::FAST);
+	CHECK(fast.duration == 1000);
+	CHECK(data.episodes()[data.episodes().size() - 2].type == episode::TIMEOUT);
+
+	CHECK(stats.size() == 2);
+	for (std::vector<flowstats>::const_iterator s = stats.begin(); s != stats.end(); ++s)
+	{
+		bool sender = s->unique_bytes != 0;
+		for (unsigned type = episode::FAST; type <= episode::SPURIOUS; ++type)
+		{
+			CHECK(s->episodes[type] == (sender ? CYCLES : 0u));
+			CHECK(s->episode_bytes[type] == (sender ? CYCLES * LEN : 0u));
+		}
+	}
+}
+
+
+
+int main()
+{
+	check_level(TRACK_COUNTERS);
+	check_level(TRACK_RANGES);
+
+	return test_status();
+}
@@ -0,0 +1,67 @@
+#include "test.h"
+#include "traces.h"
+
+
+/*
+ * Final statistics are computed by a pool of threads. Check that any number
+ * of threads gives the same statistics, in the order of the connections.
+ */
+
+#define CLIENTS 97
+
+
+
+static void check_level(const flow_table& flows, tracking level)
+{
+	std::vector<flowstats> serial, parallel;
+	finalize_stats(flows, serial, level, 1);
+
+	CHECK(serial.size() == flows.count());
+	CHECK(serial.size() == 2 * CLIENTS);
+
+	// Results are in the order of the connections
+	std::vector<flowstats>::const_iterator s = serial.begin();
+	for (flow_table::iterator it = flows.begin(); it != flows.end() && s != serial.end(); ++it, ++s)
+	{
+		CHECK(s->id == it.conn().id());
+		CHECK(s->unique_bytes == (level == TRACK_RANGES ? it.data().unique_bytes_sent() : it.data().highest_seqno()));
+	}
+
+	unsigned threads[] = { 2, 3, 8, 500 };
+	for (unsigned i = 0; i < sizeof(threads) / sizeof(threads[0]); ++i)
+	{
+		finalize_stats(flows, parallel, level, threads[i]);
+		CHECK(parallel.size() == serial.size());
+
+		for (size_t f = 0; f < serial.size() && f < parallel.size(); ++f)
+		{
+			CHECK(same_stats(serial[f], parallel[f]));
+		}
+	}
+}
+
+
+
+int main()
+{
+	std::vector<test_segment> segments;
+	uint32_t server = ADDR(10, 1, 0, 1);
+
+	for (unsigned c = 0; c < CLIENTS; ++c)
+	{
+		add_transfer(segments, c * 1000, ADDR(10, 0, c / 250, c % 250 + 1), 30000 + c, server, 5 + c % 17, 100 + c, 2000 + c * 10, c % 4 == 0 ? c % 5 + 1 : UINT32_MAX);
+	}
+
+	tracking levels[] = { TRACK_COUNTERS, TRACK_RTT, TRACK_RANGES };
+	for (unsigned i = 0; i < sizeof(levels) / sizeof(levels[0]); ++i)
+	{
+		std::vector<FILE*> files(1, write_trace(segments));
+		flow_table flows;
+		analyze(flows, files, levels[i]);
+		fclose(files[0]);
+
+		check_level(flows, levels[i]);
+	}
+
+	return test_status();
+}
@@ -0,0 +1,226 @@
+#include "test.h"
+#include "traces.h"
+#include "index.h"
+#include <cstdlib>
+#include <string>
+#include <unistd.h>
+#include <arpa/inet.h>
+
+using std::string;
+
+
+/*
+ * A sidecar index maps connections and time to record offsets. Check the
+ * encoding of offsets, saving and loading, and that analyses seeking with
+ * the index report the same as full scans.
+ */
+
+#define CLIENTS 3
+#define SEGMENTS 30
+
+static char dir[] = "/tmp/tcpstats-test-XXXXXX";
+
+
+
+static timeval at(uint64_t usecs)
+{
+	timeval ts;
+	ts.tv_sec = usecs / 1000000;
+	ts.tv_usec = usecs % 1000000;
+	return ts;
+}
+
+
+
+static void check_offsets()
+{
+	trace_index index;
+	uint64_t expected[] = { 24, 100, 100000, 100300, ((uint64_t) 1) << 33 };
+	unsigned count = sizeof(expected) / sizeof(expected[0]);
+
+	for (unsigned i = 0; i < count; ++i)
+	{
+		// Records of both directions, and of another connection in between
+		if (i % 2 == 0)
+			index.add(expected[i], at(1000000 * (i + 1)), 1, 1000, 2, 80);
+		else
+			index.add(expected[i], at(1000000 * (i + 1)), 2, 80, 1, 1000);
+		index.add(expected[i] + 10, at(1000000 * (i + 1) + 10), 3, 1000, 2, 80);
+	}
+
+	std::vector<uint64_t> offsets;
+	CHECK(index.seek_connection(offsets, 2, 80, 1, 1000));
+	CHECK(offsets == std::vector<uint64_t>(expected, expected + count));
+
+	offsets.clear();
+	CHECK(index.seek_connection(offsets, 3, 1000, 2, 80));
+	CHECK(offsets.size() == count && offsets[0] == 34);
+
+	CHECK(!index.seek_connection(offsets, 1, 1001, 2, 80));
+
+	// The time table has an entry per second of trace
+	CHECK(index.seek_time(0) == 24);
+	CHECK(index.seek_time(1000000) == 24);
+	CHECK(index.seek_time(2500000) == 100);
+	CHECK(index.seek_time(3000000) == 100000);
+	CHECK(index.seek_time(99000000) == expected[count - 1]);
+}
+
+
+
+static void check_file(const string& trace, const std::vector<flowstats>& scanned)
+{
+	FILE* fp = fopen(trace.c_str(), "r");
+	trace_index index;
+	flow_table flows;
+	filter all;
+	index_trace(flows, fp, all, TRACK_RANGES, index);
+	fclose(fp);
+	index.save(trace);
+
+	// Indexing analyzes the trace as well
+	std::vector<flowstats> indexed;
+	finalize_stats(flows, indexed, TRACK_RANGES, 1);
+	CHECK(indexed.size() == scanned.size());
+	for (size_t f = 0; f < indexed.size() && f < scanned.size(); ++f)
+	{
+		CHECK(same_stats(indexed[f], scanned[f]));
+	}
+
+	trace_index loaded;
+	CHECK(loaded.load(trace));
+
+	// Each connection has all of its records, the first right after the file header
+	for (unsigned c = 0; c < CLIENTS; ++c)
+	{
+		std::vector<uint64_t> offsets;
+		CHECK(loaded.seek_connection(offsets, htonl(ADDR(10, 1, 0, 1)), htons(80), htonl(ADDR(10, 0, 0, c + 1)), htons(30000 + c)));
+		CHECK(offsets.size() == 2 * SEGMENTS + (c == 1 ? 4 : 0));	// the lost segment adds duplicate ACKs and a retransmission
+		CHECK(c != 0 || (!offsets.empty() && offsets[0] == 24));
+	}
+	CHECK(loaded.seek_time(0) == 24);
+
+	// An index of another version of the trace is not used
+	fp = fopen(trace.c_str(), "a");
+	fputc(0, fp);
+	fclose(fp);
+	CHECK(!loaded.load(trace));
+	CHECK(truncate(trace.c_str(), 24) == 0);
+	CHECK(!loaded.load(trace));
+	CHECK(!loaded.load(trace + ".missing"));
+}
+
+
+
+/* Analyze a connection, or a time window if the connection is NULL */
+static void analyze_filtered(std::vector<flowstats>& stats, const string& trace, const char* conn, uint64_t start, const trace_index* index)
+{
+	FILE* fp = fopen(trace.c_str(), "r");
+	std::vector<FILE*> files(1, fp);
+	flow_table flows;
+	filter f;
+
+	if (conn != NULL)
+		CHECK(f.parse_connection(conn));
+	f.start = start;
+
+	analyze_trace(flows, files, f, TRACK_RANGES, index);
+	fclose(fp);
+	finalize_stats(flows, stats, TRACK_RANGES, 1);
+}
+
+
+
+/* Flows of a connection: the given flow and its reverse */
+static void check_connection(const std::vector<flowstats>& stats, const std::vector<flowstats>& scanned, const string& id)
+{
+	unsigned found = 0;
+
+	for (std::vector<flowstats>::const_iterator s = scanned.begin(); s != scanned.end(); ++s)
+	{
+		if (s->id.find(id) == string::npos)
+			continue;
+
+		for (std::vector<flowstats>::const_iterator it = stats.begin(); it != stats.end(); ++it)
+		{
+			if (it->id == s->id)
+			{
+				CHECK(same_stats(*it, *s));
+				++found;
+			}
+		}
+	}
+
+	CHECK(found == 2);
+}
+
+
+
+static void check_seek(const string& trace, const std::vector<flowstats>& scanned)
+{
+	FILE* fp = fopen(trace.c_str(), "r");
+	trace_index index;
+	flow_table flows;
+	filter all;
+	index_trace(flows, fp, all, TRACK_RANGES, index);
+	fclose(fp);
+
+	// Reading only the records of a connection
+	std::vector<flowstats> stats;
+	analyze_filtered(stats, trace, "10.0.0.2:30001-10.1.0.1:80", 0, &index);
+	CHECK(stats.size() == 2);
+	check_connection(stats, scanned, "10.0.0.2:30001");
+
+	// A connection the index doesn't know is scanned for
+	trace_index empty;
+	stats.clear();
+	analyze_filtered(stats, trace, "10.0.0.3:30002-10.1.0.1:80", 0, &empty);
+	check_connection(stats, scanned, "10.0.0.3:30002");
+
+	// Seeking to a time window gives the same as reading up to it
+	std::vector<flowstats> seeked, read;
+	analyze_filtered(seeked, trace, NULL, 3200000, &index);
+	analyze_filtered(read, trace, NULL, 3200000, NULL);
+	CHECK(!seeked.empty() && seeked.size() == read.size());
+	for (size_t f = 0; f < seeked.size() && f < read.size(); ++f)
+	{
+		CHECK(same_stats(seeked[f], read[f]));
+	}
+}
+
+
+
+int main()
+{
+	check_offsets();
+
+	if (mkdtemp(dir) == NULL)
+	{
+		perror("mkdtemp");
+		return 1;
+	}
+
+	std::vector<test_segment> segments;
+	for (unsigned c = 0; c < CLIENTS; ++c)
+	{
+		add_transfer(segments, 1000000 + c * 1000, ADDR(10, 0, 0, c + 1), 30000 + c, ADDR(10, 1, 0, 1), SEGMENTS, 1000, 100000, c == 1 ? 10 : UINT32_MAX);
+	}
+
+	string trace = string(dir) + "/trace.pcap";
+	std::vector<FILE*> files(1, write_trace(segments, trace.c_str()));
+	std::vector<flowstats> scanned;
+	analyze(scanned, files, TRACK_RANGES);
+	fclose(files[0]);
+	CHECK(scanned.size() == 2 * CLIENTS);
+
+	check_seek(trace, scanned);
+	check_file(trace, scanned);
+
+	string cleanup = string("rm -rf ") + dir;
+	if (system(cleanup.c_str()) != 0)
+	{
+		perror(cleanup.c_str());
+	}
+
+	return test_status();
+}
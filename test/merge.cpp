@@ -0,0 +1,105 @@
+#include "test.h"
+#include "traces.h"
+
+
+/*
+ * Several trace files are merged by timestamp into a single stream. Check
+ * that captures split in any way give the same statistics as one capture.
+ */
+
+#define CLIENTS 30
+
+
+
+static void check_merged(const std::vector<flowstats>& whole, std::vector<FILE*>& files)
+{
+	std::vector<flowstats> merged;
+	analyze(merged, files, TRACK_RANGES);
+
+	for (size_t i = 0; i < files.size(); ++i)
+	{
+		fclose(files[i]);
+	}
+
+	CHECK(merged.size() == whole.size());
+	for (size_t f = 0; f < merged.size() && f < whole.size(); ++f)
+	{
+		CHECK(same_stats(merged[f], whole[f]));
+	}
+}
+
+
+
+int main()
+{
+	std::vector<test_segment> segments;
+	for (unsigned c = 0; c < CLIENTS; ++c)
+	{
+		add_transfer(segments, 1000000 + c * 3000, ADDR(10, 0, 0, c + 1), 30000 + c, ADDR(10, 1, 0, 1), 20 + c, 1000, 40000, c % 4 == 1 ? c % 7 + 1 : UINT32_MAX);
+	}
+	std::stable_sort(segments.begin(), segments.end(), earlier);
+
+	std::vector<FILE*> files(1, write_trace(segments));
+	std::vector<flowstats> whole;
+	analyze(whole, files, TRACK_RANGES);
+	fclose(files[0]);
+	CHECK(whole.size() == 2 * CLIENTS);
+
+	// Rotated files, with an empty one in between
+	std::vector<test_segment> first(segments.begin(), segments.begin() + segments.size() / 3);
+	std::vector<test_segment> rest(segments.begin() + segments.size() / 3, segments.end());
+	files.clear();
+	files.push_back(write_trace(rest));
+	files.push_back(write_trace(std::vector<test_segment>()));
+	files.push_back(write_trace(first));
+	check_merged(whole, files);
+
+	// Each direction captured at a different point
+	std::vector<test_segment> sent, ackd;
+	for (std::vector<test_segment>::const_iterator it = segments.begin(); it != segments.end(); ++it)
+	{
+		(it->dst_port == 80 ? sent : ackd).push_back(*it);
+	}
+	files.clear();
+	files.push_back(write_trace(sent));
+	files.push_back(write_trace(ackd));
+	check_merged(whole, files);
+
+	// Segments scattered over many files
+	std::vector< std::vector<test_segment> > scattered(7);
+	for (size_t i = 0; i < segments.size(); ++i)
+	{
+		scattered[(i * 5) % scattered.size()].push_back(segments[i]);
+	}
+	files.clear();
+	for (size_t i = 0; i < scattered.size(); ++i)
+	{
+		files.push_back(write_trace(scattered[i]));
+	}
+	check_merged(whole, files);
+
+	// Files of different link types can't be merged
+	files.clear();
+	files.push_back(write_trace(first));
+	files.push_back(write_trace(rest));
+	uint32_t link_type = 113;	// Linux cooked capture
+	fseek(files[1], 20, SEEK_SET);
+	fwrite(&link_type, sizeof(link_type), 1, files[1]);
+	rewind(files[1]);
+
+	bool rejected = false;
+	try
+	{
+		std::vector<flowstats> stats;
+		analyze(stats, files, TRACK_RANGES);
+	}
+	catch (std::runtime_error&)
+	{
+		rejected = true;
+	}
+	CHECK(rejected);
+	fclose(files[0]);
+	fclose(files[1]);
+
+	return test_status();
+}
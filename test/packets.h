@@ -0,0 +1,161 @@
+#ifndef __PACKETS_H__
+#define __PACKETS_H__
+
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+
+
+/*
+ * Building test traces: Ethernet frames carrying IPv4 TCP segments, and pcap
+ * savefiles of them. Usable from C and C++ test programs.
+ */
+
+/* TCP flags */
+#define SEG_FIN 0x01
+#define SEG_SYN 0x02
+#define SEG_RST 0x04
+#define SEG_PSH 0x08
+#define SEG_ACK 0x10
+
+/* An IPv4 address in host byte order */
+#define ADDR(a, b, c, d) ((((uint32_t) (a)) << 24) | ((b) << 16) | ((c) << 8) | (d))
+
+/* Largest frame built (Ethernet, IP and TCP headers with options, and data) */
+#define FRAME_MAX 2048
+
+
+
+/*
+ * A TCP segment. Addresses and ports are in host byte order, the time in
+ * microseconds. The data is all zeroes.
+ */
+struct test_segment
+{
+	uint64_t time;
+	uint32_t src_addr;
+	uint32_t dst_addr;
+	uint16_t src_port;
+	uint16_t dst_port;
+	uint32_t seq;
+	uint32_t ack;
+	uint8_t flags;
+	uint16_t data_len;
+	uint16_t ip_id;			// a new IP ID for every segment by default
+	int has_ts;				// carries a TCP timestamp option
+	uint32_t tsval;
+	uint32_t tsecr;
+};
+
+
+
+static inline struct test_segment make_segment(uint64_t time, uint32_t src_addr, uint16_t src_port, uint32_t dst_addr, uint16_t dst_port, uint32_t seq, uint32_t ack, uint8_t flags, uint16_t data_len)
+{
+	static uint16_t next_id = 1;
+	struct test_segment s;
+
+	memset(&s, 0, sizeof(s));
+	s.time = time;
+	s.src_addr = src_addr;
+	s.dst_addr = dst_addr;
+	s.src_port = src_port;
+	s.dst_port = dst_port;
+	s.seq = seq;
+	s.ack = ack;
+	s.flags = flags;
+	s.data_len = data_len;
+	s.ip_id = next_id++;
+
+	return s;
+}
+
+
+
+static inline void put16(uint8_t* p, uint16_t v)
+{
+	p[0] = v >> 8;
+	p[1] = v;
+}
+
+static inline void put32(uint8_t* p, uint32_t v)
+{
+	p[0] = v >> 24;
+	p[1] = v >> 16;
+	p[2] = v >> 8;
+	p[3] = v;
+}
+
+
+
+/* Build the Ethernet frame of a segment, returns its length */
+static inline uint32_t build_frame(uint8_t* frame, const struct test_segment* s)
+{
+	uint8_t* ip = frame + 14;
+	uint8_t* tcp = ip + 20;
+	uint32_t tcp_len = s->has_ts ? 32 : 20;
+	uint32_t len = 14 + 20 + tcp_len + s->data_len;
+
+	memset(frame, 0, len);
+	put16(frame + 12, 0x0800);
+
+	ip[0] = 0x45;
+	put16(ip + 2, 20 + tcp_len + s->data_len);
+	put16(ip + 4, s->ip_id);
+	ip[8] = 64;
+	ip[9] = 6;
+	put32(ip + 12, s->src_addr);
+	put32(ip + 16, s->dst_addr);
+
+	put16(tcp, s->src_port);
+	put16(tcp + 2, s->dst_port);
+	put32(tcp + 4, s->seq);
+	put32(tcp + 8, s->ack);
+	tcp[12] = (tcp_len / 4) << 4;
+	tcp[13] = s->flags;
+	put16(tcp + 14, 65535);
+
+	if (s->has_ts)
+	{
+		tcp[20] = 1;
+		tcp[21] = 1;
+		tcp[22] = 8;
+		tcp[23] = 10;
+		put32(tcp + 24, s->tsval);
+		put32(tcp + 28, s->tsecr);
+	}
+
+	return len;
+}
+
+
+
+/* Write the header of a pcap savefile with Ethernet frames */
+static inline void write_pcap_header(FILE* fp)
+{
+	uint32_t magic = 0xa1b2c3d4;
+	uint16_t version[2] = { 2, 4 };
+	uint32_t fields[4] = { 0, 0, 65535, 1 };	// time zone, accuracy, snap length, link type
+
+	fwrite(&magic, sizeof(magic), 1, fp);
+	fwrite(version, sizeof(version), 1, fp);
+	fwrite(fields, sizeof(fields), 1, fp);
+}
+
+
+
+/* Write a segment to a pcap savefile */
+static inline void write_segment(FILE* fp, const struct test_segment* s)
+{
+	uint8_t frame[FRAME_MAX];
+	uint32_t len = build_frame(frame, s);
+	uint32_t record[4];
+
+	record[0] = s->time / 1000000;
+	record[1] = s->time % 1000000;
+	record[2] = len;
+	record[3] = len;
+	fwrite(record, sizeof(record), 1, fp);
+	fwrite(frame, len, 1, fp);
+}
+
+#endif
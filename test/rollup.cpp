@@ -0,0 +1,183 @@
+#include "test.h"
+#include "traces.h"
+#include "rollup.h"
+
+
+/*
+ * Flows are rolled up by client subnet, server port and host pair while they
+ * are updated. Check the aggregates against the statistics of the flows.
+ */
+
+#define CLIENTS 24
+#define LEN 500
+
+
+
+/* Client c, in one of two subnets, talks to one of two servers */
+static uint32_t client_addr(unsigned c)
+{
+	return ADDR(10, 0, c % 2, c / 2 + 1);
+}
+
+static uint32_t server_addr(unsigned c)
+{
+	return ADDR(10, 1, 0, 1 + c % 3 / 2);
+}
+
+static uint16_t server_port(unsigned c)
+{
+	return c % 3 == 2 ? 443 : 80;
+}
+
+
+
+static void add_segments(std::vector<test_segment>& segments)
+{
+	for (unsigned c = 0; c < CLIENTS; ++c)
+	{
+		uint32_t seq = 1000, ack = 5000;
+		uint64_t t = 1000000 + c * 1000;
+		unsigned count = 2 + c;
+
+		for (unsigned i = 0; i < count; ++i, seq += LEN, t += 10000)
+		{
+			test_segment data = make_segment(t, client_addr(c), 30000 + c, server_addr(c), server_port(c), seq, ack, SEG_ACK, LEN);
+			data.has_ts = 1;
+			data.tsval = 100 + i;
+			segments.push_back(data);
+
+			// Lost once in every third connection
+			if (i == 1 && c % 3 == 0)
+			{
+				for (unsigned d = 0; d < 3; ++d)
+					segments.push_back(make_segment(t + 100 + d, server_addr(c), server_port(c), client_addr(c), 30000 + c, ack, seq, SEG_ACK, 0));
+				segments.push_back(make_segment(t + 200, client_addr(c), 30000 + c, server_addr(c), server_port(c), seq, ack, SEG_ACK, LEN));
+			}
+
+			// Every RTT sample is 1000 usecs
+			test_segment echo = make_segment(t + 1000, server_addr(c), server_port(c), client_addr(c), 30000 + c, ack, seq + LEN, SEG_ACK, 0);
+			echo.has_ts = 1;
+			echo.tsecr = 100 + i;
+			segments.push_back(echo);
+		}
+	}
+}
+
+
+
+static void check_rollups(const std::vector<test_segment>& segments, unsigned prefix_len)
+{
+	rollup_table rollups;
+	rollups.enable(ROLLUP_SUBNET, prefix_len);
+	rollups.enable(ROLLUP_PORT);
+	rollups.enable(ROLLUP_PAIR);
+
+	std::vector<FILE*> files(1, write_trace(segments));
+	flow_table flows;
+	flows.roll_up(&rollups);
+	analyze(flows, files, TRACK_RTT);
+	fclose(files[0]);
+
+	// Totals over the flows
+	uint64_t bytes = 0, retrans = 0, dupacks = 0, samples = 0;
+	for (flow_table::iterator it = flows.begin(); it != flows.end(); ++it)
+	{
+		bytes += it.data().highest_seqno();
+		retrans += it.data().retrans_count();
+		dupacks += it.data().dupack_count();
+		samples += it.data().rtt_samples().count();
+	}
+	CHECK(retrans == CLIENTS / 3 && dupacks == 3 * CLIENTS / 3);
+	CHECK(samples == CLIENTS * 2 + CLIENTS * (CLIENTS - 1) / 2);
+
+	// Every key adds up to the totals, with every connection counted once
+	for (unsigned key = 0; key < ROLLUP_KEYS; ++key)
+	{
+		const rollup_table::aggregate_map& aggregates = rollups.aggregates((rollup_key) key);
+		aggregate sum;
+
+		for (rollup_table::aggregate_map::const_iterator it = aggregates.begin(); it != aggregates.end(); ++it)
+		{
+			sum.connections += it->second.connections;
+			sum.bytes += it->second.bytes;
+			sum.retrans += it->second.retrans;
+			sum.dupacks += it->second.dupacks;
+			for (unsigned b = 0; b < RTT_BUCKETS; ++b)
+			{
+				sum.rtt[b] += it->second.rtt[b];
+				CHECK(b == 3 || it->second.rtt[b] == 0);
+			}
+		}
+
+		CHECK(sum.connections == CLIENTS);
+		CHECK(sum.bytes == bytes);
+		CHECK(sum.retrans == retrans);
+		CHECK(sum.dupacks == dupacks);
+		CHECK(sum.rtt[3] == samples);
+	}
+
+	// Two subnets, or one for a shorter prefix
+	const rollup_table::aggregate_map& subnets = rollups.aggregates(ROLLUP_SUBNET);
+	CHECK(subnets.size() == (prefix_len == 24 ? 2u : 1u));
+	if (prefix_len == 24)
+	{
+		rollup_table::aggregate_map::const_iterator subnet = subnets.find(ADDR(10, 0, 1, 0));
+		CHECK(subnet != subnets.end() && subnet->second.connections == CLIENTS / 2);
+		CHECK(rollups.key_str(ROLLUP_SUBNET, ADDR(10, 0, 1, 0)) == "10.0.1.0/24");
+	}
+	else
+	{
+		CHECK(subnets.begin()->first == ADDR(10, 0, 0, 0));
+		CHECK(rollups.key_str(ROLLUP_SUBNET, ADDR(10, 0, 0, 0)) == "10.0.0.0/16");
+	}
+
+	// Server ports, with the bytes sent in both directions
+	const rollup_table::aggregate_map& ports = rollups.aggregates(ROLLUP_PORT);
+	CHECK(ports.size() == 2);
+	rollup_table::aggregate_map::const_iterator https = ports.find(443);
+	CHECK(https != ports.end() && https->second.connections == CLIENTS / 3);
+	uint64_t https_bytes = 0;
+	for (unsigned c = 2; c < CLIENTS; c += 3)
+	{
+		https_bytes += (2 + c) * LEN;
+	}
+	CHECK(https != ports.end() && https->second.bytes == https_bytes);
+	CHECK(rollups.key_str(ROLLUP_PORT, 443) == "port 443");
+
+	// Every client talks to one server
+	const rollup_table::aggregate_map& pairs = rollups.aggregates(ROLLUP_PAIR);
+	CHECK(pairs.size() == CLIENTS);
+	uint64_t pair = (((uint64_t) client_addr(5)) << 32) | server_addr(5);
+	CHECK(pairs.find(pair) != pairs.end() && pairs.find(pair)->second.bytes == (2 + 5) * LEN);
+	CHECK(rollups.key_str(ROLLUP_PAIR, pair) == "10.0.1.3<=>10.1.0.2");
+}
+
+
+
+int main()
+{
+	std::vector<test_segment> segments;
+	add_segments(segments);
+
+	check_rollups(segments, 24);
+	check_rollups(segments, 16);
+
+	// Only enabled keys are rolled up
+	rollup_table rollups;
+	rollups.enable(ROLLUP_PORT);
+	CHECK(!rollups.enabled(ROLLUP_SUBNET) && rollups.enabled(ROLLUP_PORT));
+
+	std::vector<FILE*> files(1, write_trace(segments));
+	flow_table flows;
+	flows.roll_up(&rollups);
+	analyze(flows, files, TRACK_COUNTERS);
+	fclose(files[0]);
+	CHECK(rollups.aggregates(ROLLUP_SUBNET).empty() && rollups.aggregates(ROLLUP_PAIR).empty());
+	CHECK(rollups.aggregates(ROLLUP_PORT).size() == 2);
+
+	CHECK(rollup_table::bucket_bound(0) == RTT_BUCKET_BASE);
+	CHECK(rollup_table::bucket_bound(3) == 8 * RTT_BUCKET_BASE);
+	CHECK(rollup_table::bucket_bound(RTT_BUCKETS - 1) == UINT64_MAX);
+
+	return test_status();
+}
@@ -0,0 +1,127 @@
+#include "test.h"
+#include "traces.h"
+#include <cmath>
+#include <arpa/inet.h>
+
+
+/*
+ * RTT samples are taken from the TCP timestamp options: a TSecr echoing a
+ * TSval gives a sample from the time that TSval was first sent.
+ */
+
+#define SEGMENTS 20
+
+
+
+static void check_estimate()
+{
+	rttstats stats;
+	CHECK(stats.count() == 0);
+	CHECK(stats.stddev() == 0);
+
+	stats.sample(10);
+	stats.sample(40);
+	stats.sample(20);
+	stats.sample(30);
+
+	CHECK(stats.count() == 4);
+	CHECK(stats.min() == 10);
+	CHECK(stats.max() == 40);
+	CHECK(fabs(stats.mean() - 25) < 1e-9);
+	CHECK(fabs(stats.stddev() - sqrt(500.0 / 3)) < 1e-9);
+}
+
+
+
+static void check_table()
+{
+	tsval_table table;
+	uint64_t time;
+
+	CHECK(!table.echoed(7, time));
+
+	// A TSval sent again keeps the time it was first sent
+	table.sent(7, 100);
+	table.sent(7, 200);
+	CHECK(table.echoed(7, time) && time == 100);
+
+	// Only the first echo gives a sample
+	CHECK(!table.echoed(7, time));
+
+	// A TSval mapping to the same slot replaces the older one
+	table.sent(7, 300);
+	table.sent(7 + TSVAL_SLOTS, 400);
+	CHECK(!table.echoed(7, time));
+	CHECK(table.echoed(7 + TSVAL_SLOTS, time) && time == 400);
+}
+
+
+
+static void check_trace(tracking level)
+{
+	std::vector<test_segment> segments;
+	uint32_t client = ADDR(10, 0, 0, 1), server = ADDR(10, 0, 0, 2);
+	uint32_t seq = 1000, ack = 5000;
+
+	for (unsigned i = 0; i < SEGMENTS; ++i, seq += 100)
+	{
+		uint64_t t = 1000000 + i * 10000;
+
+		test_segment data = make_segment(t, client, 40000, server, 80, seq, ack, SEG_ACK, 100);
+		data.has_ts = 1;
+		data.tsval = 1000 + i;
+		data.tsecr = 9000 + i;
+		segments.push_back(data);
+
+		// The ACK is repeated, with the same echoed TSval
+		for (unsigned d = 0; d < 2; ++d)
+		{
+			test_segment echo = make_segment(t + 1000 + i * 100 + d * 500, server, 80, client, 40000, ack, seq + 100, SEG_ACK, 0);
+			echo.has_ts = 1;
+			echo.tsval = 9000 + i;
+			echo.tsecr = 1000 + i;
+			segments.push_back(echo);
+		}
+	}
+
+	std::vector<FILE*> files(1, write_trace(segments));
+	flow_table flows;
+	analyze(flows, files, level);
+	fclose(files[0]);
+
+	flow_table::iterator sent = flows.find(flow(htonl(client), htons(40000), htonl(server), htons(80)));
+	flow_table::iterator ackd = flows.find(flow(htonl(server), htons(80), htonl(client), htons(40000)));
+	CHECK(sent != flows.end() && ackd != flows.end());
+	if (sent == flows.end() || ackd == flows.end())
+		return;
+
+	const rttstats& samples = sent.data().rtt_samples();
+	if (level == TRACK_COUNTERS)
+	{
+		CHECK(samples.count() == 0);
+	}
+	else
+	{
+		CHECK(samples.count() == SEGMENTS);
+		CHECK(samples.min() == 1000);
+		CHECK(samples.max() == 1000 + (SEGMENTS - 1) * 100);
+		CHECK(fabs(samples.mean() - (1000 + (SEGMENTS - 1) * 50)) < 1e-6);
+	}
+
+	// Bare ACKs don't register their TSval
+	CHECK(ackd.data().rtt_samples().count() == 0);
+}
+
+
+
+int main()
+{
+	check_estimate();
+	check_table();
+
+	check_trace(TRACK_COUNTERS);
+	check_trace(TRACK_RTT);
+	check_trace(TRACK_RANGES);
+
+	return test_status();
+}
@@ -0,0 +1,78 @@
+#include "test.h"
+#include "traces.h"
+
+
+/*
+ * With a memory limit, the range data of idle flows is spilled to disk and
+ * reloaded when they are active again. Check that spilling changes no
+ * statistics, whether a flow is reloaded by new segments or at the end.
+ */
+
+#define CLIENTS 400
+#define SEGMENTS 60
+
+
+
+int main()
+{
+	std::vector<test_segment> segments;
+	uint32_t server = ADDR(10, 1, 0, 1);
+
+	// Transfers overlap in time, so every flow is idle for a while
+	for (unsigned c = 0; c < CLIENTS; ++c)
+	{
+		add_transfer(segments, c * 5000, ADDR(10, 0, c / 250, c % 250 + 1), 30000 + c, server, SEGMENTS, 500, 400000, c % 3 == 0 ? SEGMENTS / 2 : UINT32_MAX);
+	}
+
+	std::vector<FILE*> files(1, write_trace(segments));
+	std::vector<flowstats> unlimited, limited;
+	analyze(unlimited, files, TRACK_RANGES);
+
+	rewind(files[0]);
+	flow_table flows;
+	analyze(flows, files, TRACK_RANGES, MEMORY_LIMIT_MIN);
+	fclose(files[0]);
+
+	unsigned spilled = 0;
+	for (flow_table::iterator it = flows.begin(); it != flows.end(); ++it)
+	{
+		spilled += it.data().spilled();
+	}
+	CHECK(spilled > CLIENTS / 2);
+
+	finalize_stats(flows, limited, TRACK_RANGES, 4);
+	CHECK(limited.size() == unlimited.size());
+	CHECK(limited.size() == 2 * CLIENTS);
+	for (size_t f = 0; f < limited.size() && f < unlimited.size(); ++f)
+	{
+		CHECK(same_stats(limited[f], unlimited[f]));
+	}
+
+	// A reloaded copy has the range history of the flow
+	for (flow_table::iterator it = flows.begin(); it != flows.end(); ++it)
+	{
+		if (it.data().spilled())
+		{
+			flowdata copy = it.data();
+			flows.reload(copy);
+			CHECK(!copy.spilled());
+			CHECK(copy.unique_bytes_sent() == it.data().highest_seqno());
+			break;
+		}
+	}
+
+	// Limits too small to hold the flows of a batch are rejected
+	bool rejected = false;
+	try
+	{
+		flow_table small;
+		small.set_memory_limit(MEMORY_LIMIT_MIN - 1);
+	}
+	catch (std::runtime_error&)
+	{
+		rejected = true;
+	}
+	CHECK(rejected);
+
+	return test_status();
+}
@@ -0,0 +1,34 @@
+#ifndef __TEST_H__
+#define __TEST_H__
+
+#include <stdio.h>
+
+
+/*
+ * Minimal test support, usable from C and C++ test programs.
+ * CHECK() reports a failed condition and carries on with the test, so one
+ * run shows every failure. A test program returns test_status() from main().
+ */
+static int test_failures = 0;
+
+#define CHECK(cond) \
+	do \
+	{ \
+		if (!(cond)) \
+		{ \
+			fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+			++test_failures; \
+		} \
+	} while (0)
+
+static inline int test_status(void)
+{
+	if (test_failures > 0)
+	{
+		fprintf(stderr, "%d check(s) failed\n", test_failures);
+		return 1;
+	}
+	return 0;
+}
+
+#endif
@@ -0,0 +1,115 @@
+#ifndef __TEST_TRACES_H__
+#define __TEST_TRACES_H__
+
+#include <cstdio>
+#include <vector>
+#include <algorithm>
+#include <stdexcept>
+#include "packets.h"
+#include "flow.h"
+#include "trace.h"
+#include "report.h"
+
+
+/*
+ * Helpers for C++ tests that analyze generated traces.
+ */
+
+static inline bool earlier(const test_segment& lhs, const test_segment& rhs)
+{
+	return lhs.time < rhs.time;
+}
+
+
+
+/*
+ * Write segments in time order to a pcap file, rewound for reading. Without
+ * a file name, the file is anonymous and removed once closed.
+ */
+static inline FILE* write_trace(std::vector<test_segment> segments, const char* filename = NULL)
+{
+	std::stable_sort(segments.begin(), segments.end(), earlier);
+
+	FILE* fp = filename != NULL ? fopen(filename, "w+") : tmpfile();
+	if (fp == NULL)
+	{
+		throw std::runtime_error("Unable to create a temporary trace");
+	}
+
+	write_pcap_header(fp);
+	for (std::vector<test_segment>::const_iterator it = segments.begin(); it != segments.end(); ++it)
+	{
+		write_segment(fp, &*it);
+	}
+
+	rewind(fp);
+	return fp;
+}
+
+
+
+/*
+ * Add a bulk transfer from a client to a server: count segments of len bytes
+ * starting at time start (usecs), each acknowledged rtt usecs later. The
+ * segment with index lost (if below count) is lost once, signalled with
+ * three duplicate ACKs and retransmitted.
+ */
+static inline void add_transfer(std::vector<test_segment>& segments, uint64_t start, uint32_t client, uint16_t port, uint32_t server, unsigned count, uint16_t len, uint64_t rtt, unsigned lost)
+{
+	uint32_t seq = 1000, ack = 5000;
+	uint64_t t = start;
+
+	for (unsigned i = 0; i < count; ++i, seq += len, t += rtt)
+	{
+		segments.push_back(make_segment(t, client, port, server, 80, seq, ack, SEG_ACK | SEG_PSH, len));
+
+		if (i == lost)
+		{
+			for (unsigned d = 0; d < 3; ++d)
+				segments.push_back(make_segment(t + rtt / 2 + d, server, 80, client, port, ack, seq, SEG_ACK, 0));
+			segments.push_back(make_segment(t + rtt / 2 + 10, client, port, server, 80, seq, ack, SEG_ACK | SEG_PSH, len));
+		}
+
+		segments.push_back(make_segment(t + rtt - 1, server, 80, client, port, ack, seq + len, SEG_ACK, 0));
+	}
+}
+
+
+
+/* Are the statistics of two flows the same */
+static inline bool same_stats(const flowstats& lhs, const flowstats& rhs)
+{
+	bool episodes = true;
+	for (unsigned type = episode::FAST; type <= episode::SPURIOUS; ++type)
+	{
+		episodes = episodes && lhs.episodes[type] == rhs.episodes[type] && lhs.episode_bytes[type] == rhs.episode_bytes[type];
+	}
+
+	return lhs.id == rhs.id && lhs.unique_bytes == rhs.unique_bytes && lhs.retrans == rhs.retrans
+		&& lhs.max_retrans == rhs.max_retrans && lhs.rtt == rhs.rtt && lhs.dupacks == rhs.dupacks
+		&& lhs.max_dupacks == rhs.max_dupacks && lhs.duration == rhs.duration && episodes;
+}
+
+
+
+/* Analyze trace files into a flow table */
+static inline void analyze(flow_table& flows, const std::vector<FILE*>& files, tracking level, uint64_t memory_limit = 0)
+{
+	filter f;
+
+	flows.set_memory_limit(memory_limit);
+	analyze_trace(flows, files, f, level);
+}
+
+
+
+/* Analyze trace files and compute the statistics of all flows */
+static inline void analyze(std::vector<flowstats>& stats, const std::vector<FILE*>& files, tracking level, uint64_t memory_limit = 0)
+{
+	flow_table flows;
+
+	analyze(flows, files, level, memory_limit);
+	finalize_stats(flows, stats, level, 2);
+}
+
+#endif
@@ -0,0 +1,88 @@
+#include "test.h"
+#include "traces.h"
+
+
+/*
+ * The tracking level selects the per-flow state kept at compile time. Check
+ * that each level keeps only its own state, and that the counters kept at
+ * every level agree with the range history.
+ */
+
+#define CLIENTS 20
+
+
+
+int main()
+{
+	std::vector<test_segment> segments;
+	uint32_t server = ADDR(10, 1, 0, 1);
+
+	for (unsigned c = 0; c < CLIENTS; ++c)
+	{
+		test_segment first = make_segment(1000000 + c * 1000, ADDR(10, 0, 0, c + 1), 30000 + c, server, 80, 500, 5000, SEG_ACK, 500);
+		first.has_ts = 1;
+		first.tsval = 1;
+		segments.push_back(first);
+
+		test_segment echo = make_segment(1000000 + c * 1000 + 700, server, 80, ADDR(10, 0, 0, c + 1), 30000 + c, 5000, 1000, SEG_ACK, 0);
+		echo.has_ts = 1;
+		echo.tsecr = 1;
+		segments.push_back(echo);
+
+		add_transfer(segments, 1100000 + c * 1000, ADDR(10, 0, 0, c + 1), 30000 + c, server, 10 + c, 1000, 5000, c % 2 == 0 ? c / 2 + 1 : UINT32_MAX);
+	}
+
+	tracking levels[] = { TRACK_COUNTERS, TRACK_RTT, TRACK_RANGES };
+	std::vector<flowstats> stats[3];
+
+	for (unsigned l = 0; l < 3; ++l)
+	{
+		std::vector<FILE*> files(1, write_trace(segments));
+		flow_table flows;
+		analyze(flows, files, levels[l]);
+		fclose(files[0]);
+		finalize_stats(flows, stats[l], levels[l], 1);
+
+		for (flow_table::iterator it = flows.begin(); it != flows.end(); ++it)
+		{
+			const flowdata& data = it.data();
+			bool sender = data.highest_seqno() > 0;
+
+			// Range history and RTT samples are only kept when tracked
+			CHECK((data.unique_bytes_sent() > 0) == (levels[l] == TRACK_RANGES && sender));
+			CHECK((data.rtt_samples().count() > 0) == (levels[l] != TRACK_COUNTERS && sender));
+
+			if (levels[l] == TRACK_RANGES)
+			{
+				CHECK(data.unique_bytes_sent() == data.highest_seqno());
+				CHECK(data.total_retrans() == data.retrans_count());
+				CHECK(data.total_dupacks() == data.dupack_count());
+			}
+		}
+	}
+
+	// The counters are the same at every level
+	CHECK(stats[0].size() == 2 * CLIENTS);
+	for (unsigned l = 1; l < 3; ++l)
+	{
+		CHECK(stats[l].size() == stats[0].size());
+
+		for (size_t f = 0; f < stats[0].size() && f < stats[l].size(); ++f)
+		{
+			const flowstats& lhs = stats[0][f];
+			const flowstats& rhs = stats[l][f];
+
+			CHECK(lhs.id == rhs.id);
+			CHECK(lhs.unique_bytes == rhs.unique_bytes);
+			CHECK(lhs.retrans == rhs.retrans);
+			CHECK(lhs.dupacks == rhs.dupacks);
+			CHECK(lhs.duration == rhs.duration);
+			for (unsigned type = episode::FAST; type <= episode::SPURIOUS; ++type)
+			{
+				CHECK(lhs.episodes[type] == rhs.episodes[type]);
+			}
+		}
+	}
+
+	return test_status();
+}